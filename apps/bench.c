@@ -0,0 +1,371 @@
+#include "bench.h"
+#include "../user/user.h"
+
+#define BENCH_ITERS     64
+#define BENCH_BUF_SIZE  (4096 + 64)
+
+static uint8_t bench_src[BENCH_BUF_SIZE] __attribute__((aligned(64)));
+static uint8_t bench_dst[BENCH_BUF_SIZE] __attribute__((aligned(64)));
+
+static const size_t bench_sizes[] = { 16, 64, 256, 1024, 4096 };
+
+// dst/src offsets from a 64B aligned base: both aligned, both misaligned alike, mismatched
+static const int bench_aligns[][2] = { { 0, 0 }, { 1, 1 }, { 0, 1 } };
+
+static void print_rate(size_t bytes, uint32_t cycles)
+{
+    /*
+     * printf has no floats, so bytes/cycle is printed as fixed point with 2 decimals.
+     * At most BENCH_ITERS * BENCH_BUF_SIZE bytes, so the math stays in 32 bits:
+     * there's no libgcc to do a 64 bit division on rv32.
+     */
+    if (!cycles)
+        cycles = 1;
+    uint32_t rate = bytes * 100 / cycles;
+    printf("%d.%d%d bytes/cycle\n", rate / 100, (rate / 10) % 10, rate % 10);
+}
+
+static void bench_one(const char *name, int op, size_t size, int dst_off, int src_off)
+{
+    uint8_t *dst = bench_dst + dst_off;
+    uint8_t *src = bench_src + src_off;
+
+    uint32_t start = rdcycle();
+    for (int i = 0; i < BENCH_ITERS; i++) {
+        switch (op) {
+            case 0: memcpy(dst, src, size); break;
+            case 1: memset(dst, i, size); break;
+            case 2: memmove(src + 1, src, size); break;  // overlapping, copies backwards
+        }
+    }
+    uint32_t cycles = rdcycle() - start;
+
+    printf("%s size=%d dst+%d src+%d: %d cycles, ", name, size, dst_off, src_off, cycles);
+    print_rate(size * BENCH_ITERS, cycles);
+}
+
+void bench_mem(void)
+{
+    static const char *names[] = { "memcpy", "memset", "memmove" };
+    for (int op = 0; op < 3; op++) {
+        for (unsigned s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+            for (unsigned a = 0; a < sizeof(bench_aligns) / sizeof(bench_aligns[0]); a++)
+                bench_one(names[op], op, bench_sizes[s], bench_aligns[a][0], bench_aligns[a][1]);
+        }
+    }
+
+    // strcmp over two equal strings, so the whole length gets walked
+    memset(bench_src, 'a', 1023);
+    memset(bench_dst, 'a', 1023);
+    bench_src[1023] = bench_dst[1023] = '\0';
+    uint32_t start = rdcycle();
+    for (int i = 0; i < BENCH_ITERS; i++)
+        strcmp((const char *) bench_src, (const char *) bench_dst);
+    uint32_t cycles = rdcycle() - start;
+    printf("strcmp size=1023: %d cycles, ", cycles);
+    print_rate(1023 * BENCH_ITERS, cycles);
+}
+
+#define SWITCH_ROUNDS   1000
+
+void bench_switch(void)
+{
+    /*
+     * Ping-pong between the shell and a forked child, both just yielding.
+     * Every parent round trip is two context switches.
+     */
+    int pid = fork();
+    if (pid < 0) {
+        printf("bench switch: fork failed\n");
+        return;
+    }
+    if (pid == 0) {
+        for (int i = 0; i < SWITCH_ROUNDS; i++)
+            sched_yield();
+        exit();
+    }
+
+    uint32_t start = rdcycle();
+    for (int i = 0; i < SWITCH_ROUNDS; i++)
+        sched_yield();
+    uint32_t cycles = rdcycle() - start;
+
+    printf("switch: %d round trips in %d cycles, %d cycles per switch\n",
+            SWITCH_ROUNDS, cycles, cycles / (2 * SWITCH_ROUNDS));
+}
+
+#define SCHED_ROUNDS    200
+
+static const int sched_procs[] = { 2, 8, 32, 128 };
+
+void bench_sched(void)
+{
+    /*
+     * Yield cost as the number of runnable procs grows.
+     * N - 1 children and the shell all yield in a loop, so each of the
+     * shell's rounds walks through every proc once. Flat numbers mean O(1) pick-next.
+     */
+    for (unsigned t = 0; t < sizeof(sched_procs) / sizeof(sched_procs[0]); t++) {
+        int n = sched_procs[t];
+        int spawned = 1;
+        for (; spawned < n; spawned++) {
+            int pid = fork();
+            if (pid < 0)
+                break;
+            if (pid == 0) {
+                for (int i = 0; i < SCHED_ROUNDS; i++)
+                    sched_yield();
+                exit();
+            }
+        }
+
+        uint32_t start = rdcycle();
+        for (int i = 0; i < SCHED_ROUNDS; i++)
+            sched_yield();
+        uint32_t cycles = rdcycle() - start;
+
+        printf("sched: %d procs, %d cycles per yield\n",
+                spawned, cycles / (SCHED_ROUNDS * spawned));
+
+        // let the stragglers finish before the next size
+        for (int i = 0; i < spawned; i++)
+            sched_yield();
+    }
+}
+
+#define SMP_WORK        2000000     // iterations of busy work per job
+#define SMP_JOBS_MAX    4
+#define TIME_TICKS_PER_MS 10000     // qemu virt timebase, 10MHz
+
+static void smp_job(const char *who, int jobs, uint32_t start)
+{
+    volatile uint32_t sink = 0;
+    for (uint32_t i = 0; i < SMP_WORK; i++)
+        sink += i;
+    printf("smp: %d jobs, %s done after %d ms\n", jobs, who,
+            (rdtime() - start) / TIME_TICKS_PER_MS);
+}
+
+void bench_smp(void)
+{
+    /*
+     * The same CPU-bound job run 1..SMP_JOBS_MAX at a time, the shell being one of them.
+     * Every job reports wall time since they were all started. With one hart per job
+     * the times stay flat, on a single hart they grow with the number of jobs.
+     */
+    for (int jobs = 1; jobs <= SMP_JOBS_MAX; jobs++) {
+        uint32_t start = rdtime();
+        for (int i = 1; i < jobs; i++) {
+            int pid = fork();
+            if (pid < 0)
+                break;
+            if (pid == 0) {
+                smp_job("child", jobs, start);
+                exit();
+            }
+        }
+
+        smp_job("shell", jobs, start);
+
+        // give the children a chance to finish before the next round
+        uint32_t deadline = rdtime() + (rdtime() - start);
+        while ((int) (deadline - rdtime()) > 0)
+            sched_yield();
+    }
+}
+
+#define DISK_ROUNDS     200         // sector reads per proc
+#define DISK_SECTORS    8           // spread over the first few sectors, the disk is small
+
+static const int disk_depths[] = { 1, 2, 4, 5, 8 };
+
+static void disk_job(void)
+{
+    char buf[512];
+    for (int i = 0; i < DISK_ROUNDS; i++)
+        readsector(i % DISK_SECTORS, buf, 1 | SECTOR_DIRECT);
+}
+
+void bench_disk(void)
+{
+    /*
+     * Block device IOPS against queue depth. `depth` procs, the shell being one,
+     * each issue synchronous single sector reads, so up to `depth` requests are
+     * in flight at once. The driver caps that at BLK_REQS_MAX (5) today.
+     * The shell's own time stands in for everyone's, they all run together.
+     */
+    for (unsigned t = 0; t < sizeof(disk_depths) / sizeof(disk_depths[0]); t++) {
+        int depth = disk_depths[t];
+        int spawned = 1;
+        for (; spawned < depth; spawned++) {
+            int pid = fork();
+            if (pid < 0)
+                break;
+            if (pid == 0) {
+                disk_job();
+                exit();
+            }
+        }
+
+        uint32_t start = rdtime();
+        disk_job();
+        uint32_t ms = (rdtime() - start) / TIME_TICKS_PER_MS;
+        if (!ms)
+            ms = 1;
+        printf("disk: depth %d, %d reads in %d ms, %d IOPS\n", spawned,
+                spawned * DISK_ROUNDS, ms, spawned * DISK_ROUNDS * 1000 / ms);
+
+        // let the stragglers finish before the next depth
+        uint32_t deadline = rdtime() + (rdtime() - start);
+        while ((int) (deadline - rdtime()) > 0)
+            sched_yield();
+    }
+}
+
+#define SEQ_ROUNDS      50
+#define SEQ_MAX_SECTORS 16          // 8KB, well inside the smallest tar archive
+
+static char seq_buf[SEQ_MAX_SECTORS * 512];
+
+static void seq_run(const char *what, int sectors_per_req, bool is_write)
+{
+    uint32_t start = rdtime();
+    for (int r = 0; r < SEQ_ROUNDS; r++) {
+        for (int s = 0; s < SEQ_MAX_SECTORS; s += sectors_per_req) {
+            if (is_write)
+                writesector(s, &seq_buf[s * 512], sectors_per_req | SECTOR_DIRECT);
+            else
+                readsector(s, &seq_buf[s * 512], sectors_per_req | SECTOR_DIRECT);
+        }
+    }
+    uint32_t us = (rdtime() - start) / (TIME_TICKS_PER_MS / 1000);
+    if (!us)
+        us = 1;
+    uint32_t bytes = SEQ_ROUNDS * SEQ_MAX_SECTORS * 512;
+    // bytes per microsecond is MB/s, printed with 2 decimals
+    uint32_t rate = bytes * 100 / us;
+    printf("seq %s: %d sectors per request, %d.%d%d MB/s\n", what, sectors_per_req,
+            rate / 100, (rate / 10) % 10, rate % 10);
+}
+
+void bench_seq(void)
+{
+    /*
+     * Sequential throughput over the first SEQ_MAX_SECTORS sectors,
+     * one sector per request against the whole range in one.
+     * Writes put back what was just read, so the archive survives.
+     */
+    if (readsector(0, seq_buf, SEQ_MAX_SECTORS | SECTOR_DIRECT) < 0) {
+        printf("bench seq: disk too small\n");
+        return;
+    }
+    seq_run("read", 1, false);
+    seq_run("read", SEQ_MAX_SECTORS, false);
+    seq_run("write", 1, true);
+    seq_run("write", SEQ_MAX_SECTORS, true);
+}
+
+#define CACHE_PASSES    4
+
+void bench_cache(void)
+{
+    /*
+     * The same sectors read over and over through the buffer cache.
+     * Only the first pass should reach the device, meminfo shows the hit rate
+     * and ps how many requests the disk actually saw.
+     */
+    char buf[512];
+    for (int pass = 0; pass < CACHE_PASSES; pass++) {
+        uint32_t start = rdcycle();
+        for (int s = 0; s < SEQ_MAX_SECTORS; s++)
+            readsector(s, buf, 1);
+        printf("cache: pass %d, %d cycles per sector\n", pass,
+                (rdcycle() - start) / SEQ_MAX_SECTORS);
+    }
+    meminfo();
+}
+
+#define LOOKUP_FILES    10000       // entries in lookup.tar, see `make lookup.tar`
+#define LOOKUP_ROUNDS   2000
+
+static void lookup_name(char *name, int n)
+{
+    // "lookup/fNNNNN.txt", the names the Makefile generates
+    strcpy(name, "lookup/f00000.txt");
+    for (int i = 12; i > 7; i--) {
+        name[i] = '0' + n % 10;
+        n /= 10;
+    }
+}
+
+void bench_lookup(void)
+{
+    /*
+     * Cycles per SYS_READFILE by name, spread over every entry of a
+     * LOOKUP_FILES archive. Nothing is read, so it is the syscall plus fs_lookup().
+     * Boot with DISK_IMAGE=lookup.tar, against the small archive every name misses.
+     */
+    char name[32];
+    char buf[1];
+    lookup_name(name, LOOKUP_FILES - 1);
+    if (readfile(name, buf, 0) < 0) {
+        printf("bench lookup: boot with DISK_IMAGE=lookup.tar\n");
+        return;
+    }
+
+    uint32_t cycles = 0;
+    for (int i = 0; i < LOOKUP_ROUNDS; i++) {
+        // a stride coprime with LOOKUP_FILES so consecutive lookups land far apart
+        lookup_name(name, (i * 7919) % LOOKUP_FILES);
+        uint32_t start = rdcycle();
+        readfile(name, buf, 0);
+        cycles += rdcycle() - start;
+    }
+    printf("lookup: %d files, %d cycles per readfile\n", LOOKUP_FILES, cycles / LOOKUP_ROUNDS);
+}
+
+#define CONSOLE_LINES   20
+
+static const char console_line[] = "the quick brown fox jumps over the lazy dog\n";
+
+void bench_console(void)
+{
+    /*
+     * Cycles per printed line, through the line buffered printf against
+     * one SYS_PUTCHAR trap per character, which is what printf used to cost.
+     */
+    uint32_t start = rdcycle();
+    for (int i = 0; i < CONSOLE_LINES; i++)
+        printf("%s", console_line);
+    uint32_t buffered = (rdcycle() - start) / CONSOLE_LINES;
+
+    start = rdcycle();
+    for (int i = 0; i < CONSOLE_LINES; i++) {
+        for (const char *c = console_line; *c; c++)
+            syscall(SYS_PUTCHAR, *c, 0, 0);
+    }
+    uint32_t per_char = (rdcycle() - start) / CONSOLE_LINES;
+
+    printf("console: %d cycles per line buffered, %d with a trap per char\n", buffered, per_char);
+}
+
+#define SYSCALL_ROUNDS  10000
+
+void bench_syscall(void)
+{
+    /*
+     * Round trip cost of a syscall that does nothing. SYS_NULL takes the fast path,
+     * build the kernel with -DSYSCALL_NO_FAST to time the full trap frame instead.
+     * Preemption lands in here now and then, the minimum is the honest number.
+     */
+    uint32_t total = 0, best = ~0u;
+    for (int i = 0; i < SYSCALL_ROUNDS; i++) {
+        uint32_t start = rdcycle();
+        syscall(SYS_NULL, 0, 0, 0);
+        uint32_t cycles = rdcycle() - start;
+        total += cycles;
+        if (cycles < best)
+            best = cycles;
+    }
+    printf("syscall: null, %d cycles avg, %d min\n", total / SYSCALL_ROUNDS, best);
+}
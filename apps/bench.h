@@ -0,0 +1,19 @@
+#pragma once
+#include "../common.h"
+
+/*
+ * Microbenchmarks runnable from the shell.
+ * Sizes, alignments and iteration counts are fixed so numbers can be
+ * compared between changes. Everything is timed with rdcycle.
+ */
+
+void bench_mem(void);
+void bench_switch(void);
+void bench_sched(void);
+void bench_smp(void);
+void bench_disk(void);
+void bench_seq(void);
+void bench_cache(void);
+void bench_lookup(void);
+void bench_console(void);
+void bench_syscall(void);
@@ -1,5 +1,6 @@
 #include "../common.h"
 #include "../user/user.h"
+#include "bench.h"
 
 // kind of works more like a terminal emulator
 // but really currently just for verifying reading and writing characters
@@ -30,11 +31,72 @@ void main(void)
             break;
         else if (strcmp(cmdline, "readfile") == 0) {
             char buf[128];
-            int len = readfile("hello.txt", buf, sizeof(buf));
-            buf[len] = '\0';
-            printf("%s\n", buf);
+            int len = readfile("hello.txt", buf, sizeof(buf) - 1);
+            if (len < 0) {
+                printf("readfile: can't read hello.txt\n");
+            } else {
+                buf[len] = '\0';
+                printf("%s\n", buf);
+            }
+        } else if (!memcmp(cmdline, "cat ", 4)) {
+            // streams the file in small chunks, whatever its size
+            int fd = open(cmdline + 4, O_RDONLY);
+            if (fd < 0) {
+                printf("cat: can't open %s\n", cmdline + 4);
+            } else {
+                char buf[65];
+                int len;
+                while ((len = read(fd, buf, sizeof(buf) - 1)) > 0) {
+                    buf[len] = '\0';
+                    printf("%s", buf);
+                }
+                close(fd);
+            }
         } else if (strcmp(cmdline, "writefile") == 0) {
             writefile("hello.txt", "ashkernel, reporting in.\n", 26);
+        } else if (strcmp(cmdline, "meminfo") == 0) {
+            meminfo();
+        } else if (strcmp(cmdline, "ps") == 0) {
+            ps();
+        } else if (strcmp(cmdline, "spin") == 0) {
+            // CPU bound child for checking preemption, see `ps`
+            if (fork() == 0) {
+                for (volatile uint32_t i = 0; i < 0x40000000; i++)
+                    ;
+                exit();
+            }
+        } else if (strcmp(cmdline, "fork") == 0) {
+            int pid = fork();
+            if (pid == 0) {
+                printf("hello from the child!\n");
+                exit();
+            } else if (pid < 0) {
+                printf("fork failed\n");
+            } else {
+                printf("forked child with pid %d\n", pid);
+            }
+        } else if (strcmp(cmdline, "bench mem") == 0) {
+            bench_mem();
+        } else if (strcmp(cmdline, "bench switch") == 0) {
+            bench_switch();
+        } else if (strcmp(cmdline, "bench sched") == 0) {
+            bench_sched();
+        } else if (strcmp(cmdline, "bench smp") == 0) {
+            bench_smp();
+        } else if (strcmp(cmdline, "bench disk") == 0) {
+            bench_disk();
+        } else if (strcmp(cmdline, "bench seq") == 0) {
+            bench_seq();
+        } else if (strcmp(cmdline, "bench cache") == 0) {
+            bench_cache();
+        } else if (strcmp(cmdline, "bench lookup") == 0) {
+            bench_lookup();
+        } else if (strcmp(cmdline, "bench console") == 0) {
+            bench_console();
+        } else if (strcmp(cmdline, "bench syscall") == 0) {
+            bench_syscall();
+        } else if (strcmp(cmdline, "sync") == 0) {
+            sync();
         }
         else
             printf("unrecognized command: %s\n", cmdline);
@@ -62,15 +62,42 @@ end:
     va_end(vargs);
 }
 
+/*
+ * Word-at-a-time helpers.
+ * `word_t` is the native register width (rv32 only has 4 byte words),
+ * and is allowed to alias anything so the compiler doesn't get clever with -O2.
+ */
+typedef uint32_t __attribute__((may_alias)) word_t;
+#define WORD_SIZE       sizeof(word_t)
+#define WORD_ONES       ((word_t) 0x01010101)
+#define WORD_HIGHS      ((word_t) 0x80808080)
+#define HAS_ZERO(w)     (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
 void *memset(void *buf, char c, size_t size)
 {
 	/*
 	 * set membuf at `void *buf` to `char c`
 	 * buf assumed to be of size `size`
+	 * bytes until aligned, then unrolled words, then the leftover bytes
 	 */
 	uint8_t *current = (uint8_t *) buf;
-	for (size_t i = 0; i < size; i++)
-		*current++ = c; // XXX: maybe an off by 1 error idk
+	while (size && !is_aligned(current, WORD_SIZE)) {
+		*current++ = c;
+		size--;
+	}
+
+	word_t w = WORD_ONES * (uint8_t) c;
+	word_t *wcur = (word_t *) current;
+	for (; size >= 8 * WORD_SIZE; size -= 8 * WORD_SIZE, wcur += 8) {
+		wcur[0] = w; wcur[1] = w; wcur[2] = w; wcur[3] = w;
+		wcur[4] = w; wcur[5] = w; wcur[6] = w; wcur[7] = w;
+	}
+	for (; size >= WORD_SIZE; size -= WORD_SIZE)
+		*wcur++ = w;
+
+	current = (uint8_t *) wcur;
+	while (size--)
+		*current++ = c;
 	return buf;
 }
 
@@ -78,37 +105,182 @@ void *memcpy(void *dst, const void *src, size_t n)
 {
     /*
      * Copies `n` bytes from `src` to `dst`
+     * Regions must not overlap, use `memmove` for that.
+     * Word copies only happen when both pointers share an alignment,
+     * otherwise misaligned loads could trap into M-Mode and be far slower than bytes.
      */
     uint8_t *d = (uint8_t *)dst;
-    uint8_t *s = (uint8_t *)src;
+    const uint8_t *s = (const uint8_t *)src;
+
+    if (((uint32_t) d & (WORD_SIZE - 1)) == ((uint32_t) s & (WORD_SIZE - 1))) {
+        while (n && !is_aligned(d, WORD_SIZE)) {
+            *d++ = *s++;
+            n--;
+        }
+
+        word_t *wd = (word_t *) d;
+        const word_t *ws = (const word_t *) s;
+        for (; n >= 8 * WORD_SIZE; n -= 8 * WORD_SIZE, wd += 8, ws += 8) {
+            word_t w0 = ws[0], w1 = ws[1], w2 = ws[2], w3 = ws[3];
+            word_t w4 = ws[4], w5 = ws[5], w6 = ws[6], w7 = ws[7];
+            wd[0] = w0; wd[1] = w1; wd[2] = w2; wd[3] = w3;
+            wd[4] = w4; wd[5] = w5; wd[6] = w6; wd[7] = w7;
+        }
+        for (; n >= WORD_SIZE; n -= WORD_SIZE)
+            *wd++ = *ws++;
+
+        d = (uint8_t *) wd;
+        s = (const uint8_t *) ws;
+    }
+
     while (n--)
         *d++ = *s++;
     return dst;
 }
 
+void *memmove(void *dst, const void *src, size_t n)
+{
+    /*
+     * Copies `n` bytes from `src` to `dst`, regions may overlap.
+     * Disjoint regions go to `memcpy`. Overlapping ones copy forwards when dst
+     * sits below src, a word at a time so no load ever reads what was just stored,
+     * and backwards otherwise.
+     */
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    if (d == s)
+        return dst;
+    if (d + n <= s || d >= s + n)
+        return memcpy(dst, src, n);
+
+    if (d < s) {
+        if (((uint32_t) d & (WORD_SIZE - 1)) == ((uint32_t) s & (WORD_SIZE - 1))) {
+            while (n && !is_aligned(d, WORD_SIZE)) {
+                *d++ = *s++;
+                n--;
+            }
+
+            word_t *wd = (word_t *) d;
+            const word_t *ws = (const word_t *) s;
+            for (; n >= WORD_SIZE; n -= WORD_SIZE)
+                *wd++ = *ws++;
+
+            d = (uint8_t *) wd;
+            s = (const uint8_t *) ws;
+        }
+
+        while (n--)
+            *d++ = *s++;
+        return dst;
+    }
+
+    // copy backwards from the end
+    d += n;
+    s += n;
+    if (((uint32_t) d & (WORD_SIZE - 1)) == ((uint32_t) s & (WORD_SIZE - 1))) {
+        while (n && !is_aligned(d, WORD_SIZE)) {
+            *--d = *--s;
+            n--;
+        }
+
+        word_t *wd = (word_t *) d;
+        const word_t *ws = (const word_t *) s;
+        for (; n >= 4 * WORD_SIZE; n -= 4 * WORD_SIZE) {
+            wd -= 4;
+            ws -= 4;
+            word_t w0 = ws[0], w1 = ws[1], w2 = ws[2], w3 = ws[3];
+            wd[3] = w3; wd[2] = w2; wd[1] = w1; wd[0] = w0;
+        }
+        for (; n >= WORD_SIZE; n -= WORD_SIZE)
+            *--wd = *--ws;
+
+        d = (uint8_t *) wd;
+        s = (const uint8_t *) ws;
+    }
+
+    while (n--)
+        *--d = *--s;
+    return dst;
+}
+
 void *strcpy(char *dst, const char *src)
 {
     /*
-     * Copies string from src to dst
+     * Copies string from src to dst, terminator included
      * Assumes null termination
      */
     uint8_t *d = (uint8_t *)dst;
     uint8_t *s = (uint8_t *)src;
 
-    do
-        *d++ = *s++;
-    while (*s);
+    while ((*d++ = *s++))
+        ;
 
     return dst;
 }
 
+size_t strlen(const char *s)
+{
+    const char *end = s;
+    while (*end)
+        end++;
+    return end - s;
+}
+
+int memcmp(const void *buf1, const void *buf2, size_t n)
+{
+    // same idea as strcmp, words while both buffers share an alignment, bytes to find the difference
+    const uint8_t *p1 = (const uint8_t *) buf1;
+    const uint8_t *p2 = (const uint8_t *) buf2;
+    if (((uint32_t) p1 & (WORD_SIZE - 1)) == ((uint32_t) p2 & (WORD_SIZE - 1))) {
+        while (n && !is_aligned(p1, WORD_SIZE)) {
+            if (*p1 != *p2)
+                return *p1 - *p2;
+            p1++;
+            p2++;
+            n--;
+        }
+        while (n >= WORD_SIZE && *(const word_t *) p1 == *(const word_t *) p2) {
+            p1 += WORD_SIZE;
+            p2 += WORD_SIZE;
+            n -= WORD_SIZE;
+        }
+    }
+
+    for (; n; n--, p1++, p2++) {
+        if (*p1 != *p2)
+            return *p1 - *p2;
+    }
+    return 0;
+}
+
 int strcmp(const char *s1, const char *s2)
 {
     /*
      * Comparies s1 and s2
      * - s1 == s2 -> 0
      * - else -> s1 - s2
+     *
+     * When both strings share an alignment, compare a word at a time
+     * until the words differ or one contains the terminator.
+     * Aligned word reads never cross a page, so reading past the NUL is harmless.
      */
+    if (((uint32_t) s1 & (WORD_SIZE - 1)) == ((uint32_t) s2 & (WORD_SIZE - 1))) {
+        while (!is_aligned(s1, WORD_SIZE)) {
+            if (!*s1 || *s1 != *s2)
+                return *(unsigned char *)s1 - *(unsigned char *)s2;
+            s1++;
+            s2++;
+        }
+
+        const word_t *w1 = (const word_t *) s1;
+        const word_t *w2 = (const word_t *) s2;
+        while (*w1 == *w2 && !HAS_ZERO(*w1)) {
+            w1++;
+            w2++;
+        }
+        s1 = (const char *) w1;
+        s2 = (const char *) w2;
+    }
 
     while (*s1 && *s2)
     {
@@ -119,4 +291,3 @@ int strcmp(const char *s1, const char *s2)
 
     return *(unsigned char *)s1 - *(unsigned char *)s2;
 }
-
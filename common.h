@@ -8,7 +8,7 @@ typedef uint32_t size_t;    // size of pointer
 typedef int bool;
 
 #define true    1
-#define false   1
+#define false   0
 #define NULL ((void *) 0)
 
 // __builtin_* macros brought in by clang itself, not some external header
@@ -23,7 +23,10 @@ typedef int bool;
 
 void *memset(void *buf, char c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
+void *memmove(void *dst, const void *src, size_t n);
+int memcmp(const void *buf1, const void *buf2, size_t n);
 void *strcpy(char *dst, const char *src);   // XXX: implement something more secure
+size_t strlen(const char *s);
 int strcmp(const char *s1, const char *s2);
 
 // user I/O
@@ -44,3 +47,35 @@ typedef uint32_t vaddr_t;   // virtual memory
 #define SYS_EXIT        3
 #define SYS_READFILE    4
 #define SYS_WRITEFILE   5
+#define SYS_MEMINFO     6
+#define SYS_FORK        7
+#define SYS_YIELD       8
+#define SYS_PS          9
+#define SYS_READSECTOR  10
+#define SYS_WRITESECTOR 11
+#define SYS_SYNC        12
+#define SYS_OPEN        13
+#define SYS_READ        14
+#define SYS_WRITE       15
+#define SYS_LSEEK       16
+#define SYS_CLOSE       17
+#define SYS_FSTAT       18
+#define SYS_NULL        19          // does nothing, for timing the syscall path
+
+// open() flags, Linux values
+#define O_RDONLY        0
+#define O_WRONLY        1
+#define O_RDWR          2
+#define O_ACCMODE       3
+#define O_TRUNC         0x200
+
+// lseek() whence
+#define SEEK_SET        0
+#define SEEK_CUR        1
+#define SEEK_END        2
+
+struct stat {
+    size_t size;
+};
+
+#define SECTOR_DIRECT   (1u << 31)  // or-ed into a sector count, bypasses the buffer cache
@@ -0,0 +1,58 @@
+#pragma once
+
+/*
+ * ashfs on-disk format, shared by the kernel and tools/mkfs.c.
+ * Whoever includes this brings uint16_t and uint32_t, common.h in the kernel and
+ * stdint.h on the host. Everything is little endian.
+ *
+ * Blocks are 512 byte sectors, the same unit the buffer cache deals in.
+ *
+ *  sector 0                        superblock
+ *  bitmap_start                    one bit per sector of the disk, set if taken
+ *  inode_start                     inode table, ASHFS_INODES_PER_SECTOR per sector
+ *  data_start                      extents of file and directory contents
+ *
+ * A directory's contents are an array of dirents, ino 0 marks a free one.
+ * Inode 0 is never used, the root directory is ASHFS_ROOT_INO.
+ */
+
+#define ASHFS_MAGIC             0x46485341      // "ASHF"
+#define ASHFS_SECTOR_SIZE       512
+#define ASHFS_ROOT_INO          1
+#define ASHFS_EXTENTS           7
+#define ASHFS_NAME_MAX          60              // including the terminating NUL
+
+#define ASHFS_T_FREE            0
+#define ASHFS_T_FILE            1
+#define ASHFS_T_DIR             2
+
+struct ashfs_super {
+    uint32_t magic;
+    uint32_t nsectors;          // size of the whole disk
+    uint32_t bitmap_start;
+    uint32_t bitmap_sectors;
+    uint32_t inode_start;
+    uint32_t ninodes;
+    uint32_t data_start;
+};
+
+struct ashfs_extent {
+    uint32_t start;             // first sector
+    uint32_t len;               // in sectors
+};
+
+struct ashfs_inode {
+    uint16_t type;
+    uint16_t nextents;
+    uint32_t size;              // in bytes
+    struct ashfs_extent extents[ASHFS_EXTENTS];
+};
+
+struct ashfs_dirent {
+    uint32_t ino;
+    char name[ASHFS_NAME_MAX];
+};
+
+#define ASHFS_INODES_PER_SECTOR     (ASHFS_SECTOR_SIZE / sizeof(struct ashfs_inode))
+#define ASHFS_DIRENTS_PER_SECTOR    (ASHFS_SECTOR_SIZE / sizeof(struct ashfs_dirent))
+#define ASHFS_BITS_PER_SECTOR       (ASHFS_SECTOR_SIZE * 8)
@@ -4,10 +4,17 @@
 
 extern uint8_t __bss[], __bss_end[];	// taken from kernel.ld
 
-struct proc procs[PROCS_MAX];
+struct spinlock proc_lock;      // procs table and free list
+struct proc **procs;            // indexed by pid - 1, grows by doubling
+uint32_t procs_capacity;
+uint32_t procs_count;           // slots ever handed out
+struct proc *free_procs;        // exited procs waiting to be reused
 
-struct proc *current_proc;
-struct proc *idle_proc;
+struct cpu cpus[HARTS_MAX];
+
+_Static_assert(sizeof(struct proc) <= PROC_PAGES * PAGE_SIZE, "struct proc outgrew PROC_PAGES");
+
+uint32_t time_slice_ticks = TIME_SLICE_MS * TICKS_PER_MS;
 
 // testing procs and prototypes for testing context switching
 struct proc *proc_a;
@@ -19,30 +26,54 @@ void proc_b_entry(void);
 extern char _binary_shell_bin_start[], _binary_shell_bin_size[];
 
 void virtio_blk_init(void);     // XXX: can be made more sophisticated
-void read_write_disk(void *buf, unsigned sector, bool is_write);
 void fs_init(void);
 
-void kernel_main(void)
+static void idle_loop(void)
+{
+	for (;;) {
+        zero_pool_refill();     // may as well do something useful while idle
+        yield();                // hand the CPU back as soon as anything is runnable
+        idle_wait();
+    }
+}
+
+static void init_idle_proc(void)
+{
+    // the context we booted on becomes this hart's idle proc, can return to later
+    idle_proc = init_proc(NULL, 0);
+    idle_proc->pid = 0;
+    idle_proc->on_cpu = true;
+    current_proc = idle_proc;
+}
+
+void kernel_main(uint32_t hartid)
 {
 	memset(__bss, 0, (size_t) __bss_end - (size_t) __bss);  // set bss to 0 as a sanity check
-    WRITE_CSR(stvec, (uint32_t) kernel_entry);
+    hart_init(&cpus[hartid], hartid);
 
+    mem_init();
+    uart_init();
     virtio_blk_init();  // XXX: probably want to refactor
+    bcache_init();
     fs_init();
 
+    // raw round trip through the driver. Sector 0 goes back as it was,
+    // it is the ashfs superblock or the first tar header
     char buf[SECTOR_SIZE];
     read_write_disk(buf, 0, false /* read */);
-    printf("first sector: %s\n", buf);
-    strcpy(buf, "sup shawty\n");
+    printf("first sector: %x\n", *(uint32_t *) buf);
     read_write_disk(buf, 0, true /* write */);
 
     printf("initializing idle process\n");
-    idle_proc = init_proc(NULL, 0);
-    idle_proc->pid = 0;
-    current_proc = idle_proc;   // boot process context saved, can return to later
+    init_idle_proc();
 
     printf("initializing loaded shell at addr: %d\n", (size_t) _binary_shell_bin_size);
+    uint32_t spawn_start = READ_CSR(cycle);
     init_proc(_binary_shell_bin_start, (size_t) _binary_shell_bin_size);
+    printf("shell spawned in %d cycles\n", READ_CSR(cycle) - spawn_start);
+
+    // everything shared is set up, let the other harts in
+    start_harts(hartid);
     yield();
 
     /*
@@ -53,9 +84,70 @@ void kernel_main(void)
     */
 
     printf("nothing is running. it sure is boring around here.\n");
+    idle_loop();
+}
+
+void secondary_main(uint32_t hartid)
+{
+    /*
+     * Entry point for every hart other than the boot one, started from start_harts().
+     * Nothing runs here until it steals work from another hart's run queue.
+     */
+    hart_init(&cpus[hartid], hartid);
+    init_idle_proc();
+    printf("hart %d online\n", hartid);
+
+    timer_arm(time_slice_ticks);    // wake up now and then to look for work
+    idle_loop();
+}
+
+/*
+ * --------------------------------------------------------------------------------
+ * SYNCHRONIZATION
+ * --------------------------------------------------------------------------------
+ */
+
+void spin_lock(struct spinlock *lock)
+{
+    // test-and-test-and-set, spin on plain loads so waiters don't hammer the bus with AMOs
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        while (lock->locked)
+            ;
+    }
+}
+
+void spin_unlock(struct spinlock *lock)
+{
+    __sync_lock_release(&lock->locked);
+}
+
+void sleep_lock(struct sleeplock *lock)
+{
+    spin_lock(&lock->guard);
+    while (lock->locked) {
+        wait_sleep(&lock->sleepers, &lock->guard);
+        spin_lock(&lock->guard);
+    }
+    lock->locked = true;
+    spin_unlock(&lock->guard);
+}
+
+bool sleep_trylock(struct sleeplock *lock)
+{
+    // never sleeps, so it's fine under a spinlock or from the idle proc
+    spin_lock(&lock->guard);
+    bool taken = !lock->locked;
+    lock->locked = true;
+    spin_unlock(&lock->guard);
+    return taken;
+}
 
-	for (;;)
-        __asm__ __volatile__("wfi");    // FIXME: depends on riscv
+void sleep_unlock(struct sleeplock *lock)
+{
+    spin_lock(&lock->guard);
+    lock->locked = false;
+    wake_one(&lock->sleepers);      // next in line, it still races sleep_trylock() for it
+    spin_unlock(&lock->guard);
 }
 
 /*
@@ -66,110 +158,638 @@ void kernel_main(void)
 // everything here should still apply regardless of arch
 extern char __free_ram[], __free_ram_end[];
 
-paddr_t alloc_pages(uint32_t n)
+struct spinlock mem_lock;       // everything below, including refcounts and the zero pool
+struct page *pages;             // one entry per managed page
+uint32_t pages_count;
+paddr_t ram_base;               // first page handed out by the allocator
+struct free_area free_areas[PAGE_ORDER_MAX + 1];
+
+static struct page *paddr_to_page(paddr_t paddr)
+{
+    return &pages[(paddr - ram_base) / PAGE_SIZE];
+}
+
+static paddr_t page_to_paddr(struct page *page)
+{
+    return ram_base + (page - pages) * PAGE_SIZE;
+}
+
+static void free_area_push(struct page *page, uint32_t order)
+{
+    struct free_area *area = &free_areas[order];
+    page->order = order;
+    page->flags |= PG_FREE;
+    page->prev = NULL;
+    page->next = area->head;
+    if (area->head)
+        area->head->prev = page;
+    area->head = page;
+    area->count++;
+}
+
+static void free_area_remove(struct page *page)
+{
+    struct free_area *area = &free_areas[page->order];
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        area->head = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+    page->next = page->prev = NULL;
+    page->flags &= ~PG_FREE;
+    area->count--;
+}
+
+uint32_t pages_to_order(uint32_t n)
+{
+    uint32_t order = 0;
+    while ((1u << order) < n)
+        order++;
+    return order;
+}
+
+void mem_init(void)
+{
+    /*
+     * Sets up the buddy allocator.
+     * The page table lives at the start of free RAM, everything after it
+     * gets split into the largest naturally aligned blocks that fit.
+     */
+    paddr_t start = align_up((paddr_t) __free_ram, PAGE_SIZE);
+    uint32_t total = ((paddr_t) __free_ram_end - start) / PAGE_SIZE;
+    uint32_t meta_pages = align_up(total * sizeof(struct page), PAGE_SIZE) / PAGE_SIZE;
+
+    pages = (struct page *) start;
+    pages_count = total - meta_pages;
+    ram_base = start + meta_pages * PAGE_SIZE;
+    memset(pages, 0, pages_count * sizeof(struct page));
+
+    uint32_t idx = 0;
+    while (idx < pages_count) {
+        uint32_t order = PAGE_ORDER_MAX;
+        while ((idx & ((1u << order) - 1)) || idx + (1u << order) > pages_count)
+            order--;
+        free_area_push(&pages[idx], order);
+        idx += 1u << order;
+    }
+}
+
+static paddr_t buddy_alloc(uint32_t order)
 {
     /*
-     * Allocates `n` pages
-     * Simple bump allocator for now.
-     * TODO: make more sophisticated-- we want high memory utilization
-     * and ways to free pages.
-     * RISC-V also likely has some MMU utility we can wrangle here for S-Mode vs M-Mode.
-     * Also always panics on invalid requests-- may want to propagate an "invalid request" sort of signal instead for
+     * Pulls a 2^order block off the free lists, splitting larger blocks as needed.
+     * Returns 0 if nothing large enough is free. Contents are left as-is.
+     */
+    uint32_t current = order;
+    while (current <= PAGE_ORDER_MAX && !free_areas[current].head)
+        current++;
+    if (current > PAGE_ORDER_MAX)
+        return 0;
+
+    struct page *page = free_areas[current].head;
+    free_area_remove(page);
+
+    // split down, handing the upper halves back to the smaller free lists
+    while (current > order) {
+        current--;
+        free_area_push(page + (1u << current), current);
+    }
+    page->order = order;
+    page->refcount = 1;
+
+    return page_to_paddr(page);
+}
+
+static void buddy_free(paddr_t paddr, uint32_t order)
+{
+    /*
+     * Returns a block of 2^order pages to the free lists,
+     * merging with its buddy for as long as the buddy is also free.
+     */
+    if (paddr < ram_base || !is_aligned(paddr - ram_base, PAGE_SIZE << order))
+        PANIC("free_pages: bad paddr %x for order %d", paddr, order);
+
+    uint32_t idx = (paddr - ram_base) / PAGE_SIZE;
+    if (idx + (1u << order) > pages_count)
+        PANIC("free_pages: block at %x runs past end of memory", paddr);
+    if (pages[idx].flags & PG_FREE)
+        PANIC("free_pages: double free of %x", paddr);
+    pages[idx].refcount = 0;
+
+    while (order < PAGE_ORDER_MAX) {
+        uint32_t buddy = idx ^ (1u << order);
+        if (buddy + (1u << order) > pages_count)
+            break;
+        if (!(pages[buddy].flags & PG_FREE) || pages[buddy].order != order)
+            break;
+
+        free_area_remove(&pages[buddy]);
+        if (buddy < idx)
+            idx = buddy;
+        order++;
+    }
+
+    free_area_push(&pages[idx], order);
+}
+
+paddr_t zero_pool[ZERO_POOL_MAX];
+uint32_t zero_pool_count;
+
+static void zero_pool_drain(void)
+{
+    // mem_lock held
+    while (zero_pool_count)
+        buddy_free(zero_pool[--zero_pool_count], 0);
+}
+
+void zero_pool_refill(void)
+{
+    /*
+     * Tops up the pre-zeroed pool by at most ZERO_POOL_BATCH pages.
+     * Meant to be called from places where the kernel is otherwise just waiting.
+     * The zeroing itself happens outside the lock.
+     */
+    for (int i = 0; i < ZERO_POOL_BATCH; i++) {
+        spin_lock(&mem_lock);
+        paddr_t page = zero_pool_count < ZERO_POOL_MAX ? buddy_alloc(0) : 0;
+        spin_unlock(&mem_lock);
+        if (!page)
+            return;
+
+        memset((void *) page, 0, PAGE_SIZE);
+
+        spin_lock(&mem_lock);
+        if (zero_pool_count < ZERO_POOL_MAX)
+            zero_pool[zero_pool_count++] = page;
+        else
+            buddy_free(page, 0);    // another hart filled it up first
+        spin_unlock(&mem_lock);
+    }
+}
+
+paddr_t alloc_pages_flags(uint32_t n, uint32_t flags)
+{
+    /*
+     * Allocates `n` pages, rounded up to the next power of two.
+     * The block must be handed back with `free_pages(paddr, pages_to_order(n))`.
+     * Pages are zeroed unless ALLOC_NOZERO is passed.
+     * Always panics on invalid requests-- may want to propagate an "invalid request" sort of signal instead for
      * a robust system.
      *
      * XXX: should this go in riscv.c?
      */
-    if (n * PAGE_SIZE == 0 && n != 0)
-        PANIC("requested number of pages (%x) causes an overflow");
+    if (n > pages_count)
+        PANIC("requested number of pages (%x) is larger than memory", n);
+
+    bool zero = !(flags & ALLOC_NOZERO);
+    uint32_t order = pages_to_order(n);
 
-    static paddr_t next_paddr = (paddr_t) __free_ram;
-    paddr_t paddr = next_paddr;
-    next_paddr += n * PAGE_SIZE;
+    spin_lock(&mem_lock);
+    if (zero && n <= 1 && zero_pool_count) {
+        paddr_t page = zero_pool[--zero_pool_count];
+        spin_unlock(&mem_lock);
+        return page;
+    }
 
-    if (next_paddr > (paddr_t) __free_ram_end)
+    paddr_t paddr = buddy_alloc(order);
+    if (!paddr) {
+        // the pool may be holding the pages we need
+        zero_pool_drain();
+        paddr = buddy_alloc(order);
+    }
+    spin_unlock(&mem_lock);
+    if (!paddr)
         PANIC("out of memory");
 
     // allocating newly allocated pages to 0 ensures consistency and security
-    memset((void *) paddr, 0, n * PAGE_SIZE);
+    if (zero)
+        memset((void *) paddr, 0, (1u << order) * PAGE_SIZE);
 
     return paddr;
 }
 
+paddr_t alloc_pages(uint32_t n)
+{
+    return alloc_pages_flags(n, 0);
+}
+
+void free_pages(paddr_t paddr, uint32_t order)
+{
+    spin_lock(&mem_lock);
+    buddy_free(paddr, order);
+    spin_unlock(&mem_lock);
+}
+
+/*
+ * Reference counts for blocks mapped in more than one place.
+ * Whoever allocates a block holds the first reference,
+ * and the block goes back to the allocator when the last one is dropped.
+ */
+void page_ref(paddr_t paddr)
+{
+    spin_lock(&mem_lock);
+    paddr_to_page(paddr)->refcount++;
+    spin_unlock(&mem_lock);
+}
+
+void page_unref(paddr_t paddr)
+{
+    spin_lock(&mem_lock);
+    struct page *page = paddr_to_page(paddr);
+    if (!page->refcount)
+        PANIC("page_unref: %x has no references", paddr);
+    if (--page->refcount == 0)
+        buddy_free(paddr, page->order);
+    spin_unlock(&mem_lock);
+}
+
+uint32_t page_refcount(paddr_t paddr)
+{
+    return paddr_to_page(paddr)->refcount;
+}
+
+void mem_dump(void)
+{
+    /*
+     * Prints free blocks per order and a rough fragmentation figure:
+     * the percentage of free memory that isn't in the largest free block.
+     */
+    uint32_t free_total = 0;
+    uint32_t largest = 0;
+    spin_lock(&mem_lock);
+    printf("mem: %d pages managed at %x\n", pages_count, ram_base);
+    for (uint32_t order = 0; order <= PAGE_ORDER_MAX; order++) {
+        struct free_area *area = &free_areas[order];
+        if (!area->count)
+            continue;
+        printf("  order %d: %d free blocks (%d pages)\n",
+                order, area->count, area->count << order);
+        free_total += area->count << order;
+        largest = 1u << order;
+    }
+
+    uint32_t frag = free_total ? 100 - (largest * 100) / free_total : 0;
+    printf("mem: %d/%d pages free, fragmentation %d%%\n",
+            free_total, pages_count, frag);
+    printf("mem: %d pre-zeroed pages pooled\n", zero_pool_count);
+    spin_unlock(&mem_lock);
+}
+
 /*
  * --------------------------------------------------------------------------------
  * PROCESS MANAGEMENT
  * --------------------------------------------------------------------------------
  */
 
-extern char __kernel_base[];
-struct proc *init_proc(const void *image, size_t image_size)
+static void runq_push(struct runqueue *rq, struct proc *proc)
 {
-    // TODO: revisit and ensure this is all machine independent
+    // to the back of its priority level
+    spin_lock(&rq->lock);
+    proc->rq_next = NULL;
+    if (rq->tails[proc->priority])
+        rq->tails[proc->priority]->rq_next = proc;
+    else
+        rq->heads[proc->priority] = proc;
+    rq->tails[proc->priority] = proc;
+    rq->bitmap |= 1u << proc->priority;
+    spin_unlock(&rq->lock);
+}
+
+static struct proc *runq_pop(struct runqueue *rq)
+{
+    // front of the most important non-empty level, or NULL
+    if (!rq->bitmap)
+        return NULL;    // racy peek, saves taking the lock on an empty queue
+
+    spin_lock(&rq->lock);
     struct proc *proc = NULL;
-    int taken_id;
-    for (taken_id = 0; taken_id < PROCS_MAX; taken_id++) {
-        if (procs[taken_id].state == UNUSED) {
-            proc = &procs[taken_id];
-            break;
+    if (rq->bitmap) {
+        int prio = __builtin_ctz(rq->bitmap);
+        proc = rq->heads[prio];
+        rq->heads[prio] = proc->rq_next;
+        if (!rq->heads[prio]) {
+            rq->tails[prio] = NULL;
+            rq->bitmap &= ~(1u << prio);
         }
+        proc->rq_next = NULL;
     }
+    spin_unlock(&rq->lock);
+    return proc;
+}
+
+static struct proc *runq_steal(struct cpu *thief)
+{
+    // this hart has nothing to do, take work from whoever has some
+    for (int i = 0; i < HARTS_MAX; i++) {
+        if (&cpus[i] == thief)
+            continue;
+        struct proc *proc = runq_pop(&cpus[i].rq);
+        if (proc)
+            return proc;
+    }
+    return NULL;
+}
+
+static bool procs_grow(void)
+{
+    // doubles the proc table, returns false once PROCS_MAX is hit
+    if (procs_capacity >= PROCS_MAX)
+        return false;
+
+    uint32_t capacity = procs_capacity ? procs_capacity * 2 : PROCS_INIT;
+    uint32_t table_pages = align_up(capacity * sizeof(struct proc *), PAGE_SIZE) / PAGE_SIZE;
+    struct proc **table = (struct proc **) alloc_pages(table_pages);
+    if (procs) {
+        memcpy(table, procs, procs_capacity * sizeof(struct proc *));
+        uint32_t old_pages = align_up(procs_capacity * sizeof(struct proc *), PAGE_SIZE) / PAGE_SIZE;
+        free_pages((paddr_t) procs, pages_to_order(old_pages));
+    }
+    procs = table;
+    procs_capacity = capacity;
+    return true;
+}
+
+static struct proc *alloc_proc(void)
+{
+    // returns a free proc with its pid set, or NULL if PROCS_MAX are alive
+    // exited procs already had their memory handed back in finish_switch()
+    spin_lock(&proc_lock);
+    struct proc *proc = free_procs;
+    if (proc) {
+        free_procs = proc->rq_next;
+    } else {
+        if (procs_count == procs_capacity && !procs_grow()) {
+            spin_unlock(&proc_lock);
+            return NULL;
+        }
+        proc = (struct proc *) alloc_pages(PROC_PAGES);
+        procs[procs_count++] = proc;
+        proc->pid = procs_count;
+    }
+    spin_unlock(&proc_lock);
+
+    proc->priority = PRIO_DEFAULT;
+    proc->rq_next = NULL;
+    proc->on_cpu = false;
+    proc->asid_gen = 0;     // never reuse the last owner's TLB entries
+    proc->ready_since = proc->run_start = READ_CSR(time);
+    proc->runtime_us = proc->max_wait_us = 0;
+    proc->nr_switches = proc->nr_preempted = 0;
+    memset(proc->fds, 0, sizeof(proc->fds));
+    return proc;
+}
+
+extern char __kernel_base[];
+struct proc *init_proc(const void *image, size_t image_size)
+{
+    // TODO: revisit and ensure this is all machine independent
+    struct proc *proc = alloc_proc();
     if (!proc) PANIC("couldn't init proc, all procs in use");   // XXX: likely want to not panic
-    proc->pid = taken_id + 1;
     
     proc = init_proc_ctx(proc, image, image_size);
 
+    // stdin, stdout, stderr
+    for (int fd = 0; fd < 3; fd++) {
+        proc->fds[fd].type = FD_CONSOLE;
+        proc->fds[fd].flags = fd ? O_WRONLY : O_RDONLY;
+    }
+
     // prepare pages
     uint32_t *page_table = (uint32_t *) alloc_pages(1);
 
     // map kernel pages
-    for (paddr_t paddr = (paddr_t) __kernel_base;
-            paddr < (paddr_t) __free_ram_end; paddr += PAGE_SIZE)
-        map_page_sv32(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
-    // map user pages
-    for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
-        paddr_t page = alloc_pages(1);
+    // 4MB megapages straight in the root table, so this costs a handful of PTEs
+    // and no 2nd level tables no matter how much RAM there is
+    for (paddr_t paddr = (paddr_t) __kernel_base & ~(MEGAPAGE_SIZE - 1);
+            paddr < (paddr_t) __free_ram_end; paddr += MEGAPAGE_SIZE)
+        map_megapage_sv32(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X | PAGE_G);
+    // device MMIO, the kernel touches it from whichever proc is current
+    map_megapage_sv32(page_table, VIRTIO_BLK_PADDR & ~(MEGAPAGE_SIZE - 1),
+            VIRTIO_BLK_PADDR & ~(MEGAPAGE_SIZE - 1), PAGE_R | PAGE_W | PAGE_G);
+    map_megapage_sv32(page_table, PLIC_PADDR, PLIC_PADDR, PAGE_R | PAGE_W | PAGE_G);
+    // user pages are mapped lazily by demand_page() as they're touched
+    proc->image = image;
+    proc->image_size = image_size;
+
+    proc->page_table = page_table;
+    proc->state = RUNNABLE;
+    if (image)      // idle procs have no image, yield() falls back to them instead of queueing them
+        runq_push(&this_cpu()->rq, proc);
+
+    return proc;
+}
+
+int fork_proc(struct trap_frame *frame, uint32_t user_pc)
+{
+    /*
+     * Duplicates current_proc. User pages are shared copy-on-write,
+     * so the cost is the page table walk rather than the image size.
+     * The child resumes at `user_pc` with the parent's registers and 0 in a0.
+     * Returns the child's pid, or -1 if no slot is free.
+     */
+    struct proc *child = alloc_proc();
+    if (!child)
+        return -1;
+
+    child->page_table = copy_page_table_sv32(current_proc->page_table);
+    child->image = current_proc->image;     // pages the parent never touched still come from here
+    child->image_size = current_proc->image_size;
+    memcpy(child->fds, current_proc->fds, sizeof(child->fds));
+    init_fork_ctx(child, frame, user_pc);
+    child->priority = current_proc->priority;
+    child->state = RUNNABLE;
+    runq_push(&this_cpu()->rq, child);
+
+    return child->pid;
+}
+
+bool demand_page(struct proc *proc, vaddr_t vaddr)
+{
+    /*
+     * Maps the user page containing `vaddr` on first touch.
+     * Pages covered by the image are filled from it, anything past the end
+     * (bss, stack, and whatever else the proc grows into) gets a zeroed page.
+     * Returns false if `vaddr` is outside user memory or already mapped,
+     * meaning the fault is someone else's problem. That includes a kernel
+     * megapage, should one ever end up inside the user window.
+     */
+    if (vaddr < USER_BASE || vaddr >= USER_END)
+        return false;
+    if (in_megapage_sv32(proc->page_table, vaddr))
+        return false;
+
+    vaddr_t page_vaddr = vaddr & ~(PAGE_SIZE - 1);
+    uint32_t *pte = walk_sv32(proc->page_table, page_vaddr);
+    if (pte && (*pte & PAGE_V))
+        return false;
+
+    uint32_t off = page_vaddr - USER_BASE;
+    paddr_t page;
+    if (off < proc->image_size) {
+        page = alloc_pages_flags(1, ALLOC_NOZERO);    // about to be overwritten
 
         // data to be copied may be smaller than page size
-        size_t remaining = image_size - off;
+        size_t remaining = proc->image_size - off;
         size_t copy_size = (PAGE_SIZE <= remaining) ? PAGE_SIZE : remaining;
 
-        // fill and map page
-        memcpy((void *) page, image + off, copy_size);
-        map_page_sv32(page_table, USER_BASE + off, page,
-                PAGE_U | PAGE_R | PAGE_W | PAGE_X);
+        // fill page, zeroing whatever the image doesn't cover
+        memcpy((void *) page, proc->image + off, copy_size);
+        memset((void *) (page + copy_size), 0, PAGE_SIZE - copy_size);
+    } else {
+        page = alloc_pages(1);
     }
 
-    proc->page_table = page_table;
-    proc->state = RUNNABLE;
-    proc->page_table = page_table;
-
-    return proc;
+    map_page_sv32(proc->page_table, page_vaddr, page,
+            PAGE_U | PAGE_R | PAGE_W | PAGE_X);
+    __asm__ __volatile__("sfence.vma %0, zero" :: "r"(page_vaddr) : "memory");    // FIXME: depends on riscv
+    return true;
 }
 
-void yield(void)
+static void schedule(struct spinlock *held)
 {
-    // search for a runnable proc
-    // simple round-robin, find next in circle after current proc, then run
+    // round-robin within a priority level, higher levels always go first.
     // currently must be called at startup as process 0 is the idle process
     // and we want to move on to an actual process.
     // Essentially, to run actual user processes, need to yield the idle process.
-    struct proc *next = idle_proc;
-    for (int i = 0; i < PROCS_MAX; i++) {
-        struct proc *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-        if (proc->state == RUNNABLE && proc->pid > 0) {
-            next = proc;
-            break;
-        }
-    }
+    struct cpu *cpu = this_cpu();
+    struct proc *prev = current_proc;
+    if (prev != idle_proc && prev->state == RUNNABLE)
+        runq_push(&cpu->rq, prev);
+    if (held)
+        spin_unlock(held);      // see sleep()
 
-    if (next == current_proc) return;   // circled around and selected self
+    struct proc *next = runq_pop(&cpu->rq);
+    if (!next)
+        next = runq_steal(cpu);
+    if (!next)
+        next = idle_proc;
+
+    if (next == prev) return;   // circled around and selected self
+
+    // whichever hart ran `next` last might not be done saving its registers yet
+    while (next->on_cpu)
+        ;
+    next->on_cpu = true;
 
     save_kern_state(next);
 
+    // accounting, 32 bits of ticks is plenty for a single delta
+    uint32_t now = READ_CSR(time);
+    prev->runtime_us += (now - prev->run_start) / TICKS_PER_US;
+    prev->ready_since = now;
+    uint32_t wait_us = (now - next->ready_since) / TICKS_PER_US;
+    if (wait_us > next->max_wait_us)
+        next->max_wait_us = wait_us;
+    next->run_start = now;
+    next->nr_switches++;
+
+    timer_arm(time_slice_ticks);    // fresh slice for whoever is next
+
     // switch
-    struct proc *prev = current_proc;
+    cpu->prev_proc = prev;
     current_proc = next;
     switch_context(&prev->sp, &next->sp);
+    finish_switch();
+}
+
+void yield(void)
+{
+    schedule(NULL);
+}
+
+void sleep(struct spinlock *lock)
+{
+    /*
+     * Blocks current_proc until someone wakeup()s it. `lock` guards whatever
+     * is being waited on and is held by the caller, who has already put the proc
+     * somewhere the waker will find it. It's dropped once the scheduler has
+     * decided not to requeue the proc, so a wakeup either sees BLOCKED or
+     * hasn't started yet. Returns with `lock` released.
+     */
+    current_proc->state = BLOCKED;
+    schedule(lock);
+}
+
+void wakeup(struct proc *proc)
+{
+    // caller holds the lock `proc` went to sleep with
+    if (proc->state != BLOCKED)
+        return;
+    proc->state = RUNNABLE;
+    proc->ready_since = READ_CSR(time);
+    runq_push(&this_cpu()->rq, proc);
+}
+
+void wait_sleep(struct waitqueue *wq, struct spinlock *lock)
+{
+    // `lock` held, it guards `wq`. Queues current_proc at the back and sleep()s
+    struct proc *proc = current_proc;
+    proc->rq_next = NULL;
+    if (wq->tail)
+        wq->tail->rq_next = proc;
+    else
+        wq->head = proc;
+    wq->tail = proc;
+    sleep(lock);
+}
+
+void wake_one(struct waitqueue *wq)
+{
+    // the longest sleeper on `wq`, if any. Its lock held as for wait_sleep()
+    struct proc *proc = wq->head;
+    if (!proc)
+        return;
+    wq->head = proc->rq_next;
+    if (!wq->head)
+        wq->tail = NULL;
+    wakeup(proc);       // reuses rq_next, so only once it's off `wq`
+}
+
+void wake_all(struct waitqueue *wq)
+{
+    // everyone rechecks whatever they were waiting for
+    while (wq->head)
+        wake_one(wq);
+}
+
+void finish_switch(void)
+{
+    /*
+     * Runs on the new proc's stack, right after switch_context.
+     * Brand new procs get here from user_entry/fork_entry instead.
+     * Only now is the previous proc's stack free for another hart to use.
+     */
+    struct proc *prev = this_cpu()->prev_proc;
+    if (prev->state == EXITED && prev->page_table) {
+        // satp already points at the new proc's table, so it's safe to tear down prev's
+        free_page_table_sv32(prev->page_table);
+        prev->page_table = NULL;
+
+        spin_lock(&proc_lock);
+        prev->rq_next = free_procs;
+        free_procs = prev;
+        spin_unlock(&proc_lock);
+    }
+
+    __sync_synchronize();   // registers saved before anyone else can pick prev up
+    prev->on_cpu = false;
+}
+
+void proc_dump(void)
+{
+    // per proc accounting, for checking fairness and scheduling latency
+    static const char *states[] = { "unused", "runnable", "blocked", "exited" };
+    printf("pid  state     runtime(us)  max wait(us)  switches  preempted\n");
+    spin_lock(&proc_lock);
+    for (uint32_t i = 0; i < procs_count; i++) {
+        struct proc *proc = procs[i];
+        if (proc->state == UNUSED)
+            continue;
+        printf("%d    %s  %d  %d  %d  %d\n", proc->pid, states[proc->state],
+                proc->runtime_us, proc->max_wait_us, proc->nr_switches, proc->nr_preempted);
+    }
+    spin_unlock(&proc_lock);
 }
 
 /*
@@ -194,10 +814,20 @@ void virtio_reg_fetch_and_or32(unsigned offset, uint32_t value)
     virtio_reg_write32(offset, virtio_reg_read32(offset) | value);
 }
 
+struct spinlock disk_lock;      // everything below
 struct virtio_virtq *blk_request_vq;
-struct virtio_blk_req *blk_req;
-paddr_t blk_req_paddr;
+struct virtio_blk_req *blk_reqs;            // BLK_REQS_MAX of them, shared with the device
+paddr_t blk_reqs_paddr;
+struct blk_slot blk_slots[BLK_REQS_MAX];
+struct blk_slot *blk_head_slot[VIRTQ_ENTRY_NUM];    // used ring id -> request
 uint64_t blk_capacity;
+struct waitqueue disk_slot_wait;    // procs waiting for a free slot
+
+// per request accounting, in timer ticks. cpu is latency minus time spent asleep
+uint32_t disk_requests;
+uint32_t disk_bytes;
+uint32_t disk_latency_ticks;
+uint32_t disk_cpu_ticks;
 
 struct virtio_virtq *virtq_init(unsigned index)
 {
@@ -217,6 +847,10 @@ struct virtio_virtq *virtq_init(unsigned index)
     struct virtio_virtq *vq = (struct virtio_virtq *) virtq_paddr;
     vq->queue_index = index;
     vq->used_index = (volatile uint16_t *) &vq->used.index;
+    for (uint16_t i = 0; i < VIRTQ_ENTRY_NUM - 1; i++)
+        vq->descs[i].next = i + 1;
+    vq->free_head = 0;
+    vq->num_free = VIRTQ_ENTRY_NUM;
     // 1.
     virtio_reg_write32(VIRTIO_REG_QUEUE_SEL, index);
     // 5.
@@ -275,78 +909,631 @@ void virtio_blk_init(void)
     printf("virtio-blk: capacity is %d bytes\n", blk_capacity);
 
     // allocate region to store requests to device
-    blk_req_paddr = alloc_pages(align_up(sizeof(*blk_req), PAGE_SIZE) / PAGE_SIZE);
-    blk_req = (struct virtio_blk_req *) blk_req_paddr;
+    blk_reqs_paddr = alloc_pages(align_up(sizeof(*blk_reqs) * BLK_REQS_MAX, PAGE_SIZE) / PAGE_SIZE);
+    blk_reqs = (struct virtio_blk_req *) blk_reqs_paddr;
+
+    // completions come in as interrupts, see virtio_blk_irq()
+    plic_enable(VIRTIO_BLK_IRQ);
+}
+
+static uint16_t virtq_desc_alloc(struct virtio_virtq *vq)
+{
+    // caller checked num_free
+    uint16_t i = vq->free_head;
+    vq->free_head = vq->descs[i].next;
+    vq->num_free--;
+    return i;
+}
+
+static void virtq_desc_free_chain(struct virtio_virtq *vq, uint16_t head)
+{
+    uint16_t i = head;
+    for (;;) {
+        bool more = vq->descs[i].flags & VIRTQ_DESC_F_NEXT;
+        uint16_t next = vq->descs[i].next;
+        vq->descs[i].next = vq->free_head;
+        vq->free_head = i;
+        vq->num_free++;
+        if (!more)
+            break;
+        i = next;
+    }
 }
 
 void virtq_kick(struct virtio_virtq *vq, int desc_index)
 {
     vq->avail.ring[vq->avail.index % VIRTQ_ENTRY_NUM] = desc_index;
+    __sync_synchronize();   // chain visible before the index that publishes it
     vq->avail.index++;
     __sync_synchronize();
     virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
-    vq->last_used_index++;
 }
 
-bool virtq_is_busy(struct virtio_virtq *vq)
+static void blk_reap(void)
 {
-    return vq->last_used_index != *vq->used_index;
+    /*
+     * disk_lock held. Marks every request the device has finished since last time
+     * as done and wakes its proc. Completions can come back in any order,
+     * the used ring's id says which chain each one was.
+     */
+    struct virtio_virtq *vq = blk_request_vq;
+    while (vq->last_used_index != *vq->used_index) {
+        __sync_synchronize();   // index read before the entry it covers
+        volatile struct virtq_used_elem *elem = &vq->used.ring[vq->last_used_index % VIRTQ_ENTRY_NUM];
+        uint16_t head = elem->id;
+        vq->last_used_index++;
+
+        struct blk_slot *slot = blk_head_slot[head];
+        virtq_desc_free_chain(vq, head);
+        slot->done = true;
+        wake_all(&slot->waiters);
+    }
 }
 
-void read_write_disk(void *buf, unsigned sector, bool is_write)
+static uint32_t disk_wait(struct waitqueue *wq)
 {
-    // 1. Construct a request in blk_req. Specify the sector number, and r/w.
-    // 2. Construct a descriptor chain pointing to each area of blk_req.
-    // 3. Add the index of the head descriptor of the descriptor chain to the Available Ring.
-    // 4. Notify the device that there is a new pending request.
-    // 5. Wait until the device finished processing.
-    // 6. Check the response from the device.
-
-    if (sector >= blk_capacity / SECTOR_SIZE) {
-        printf("virtio: tried to read/write sector=%d, but capacity is %d\n",
-              sector, blk_capacity / SECTOR_SIZE);
-        return;
+    /*
+     * Waits for the disk to make progress, with disk_lock held on entry and return.
+     * Returns the ticks spent asleep.
+     * The idle proc can't sleep, and neither can boot before it exists, so those
+     * just poll. The ring is checked directly, the interrupt doesn't get in here.
+     */
+    struct proc *proc = current_proc;
+    if (!proc || proc == idle_proc) {
+        spin_unlock(&disk_lock);
+        spin_lock(&disk_lock);
+        return 0;
     }
 
-    // Construct the request according to the virtio-blk specification.
-    blk_req->sector = sector;
-    blk_req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    if (is_write)
-        memcpy(blk_req->data, buf, SECTOR_SIZE);
-
-    // Construct the virtqueue descriptors (using 3 descriptors).
-    struct virtio_virtq *vq = blk_request_vq;
-    vq->descs[0].addr = blk_req_paddr;
-    vq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-    vq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-    vq->descs[0].next = 1;
-
-    vq->descs[1].addr = blk_req_paddr + offsetof(struct virtio_blk_req, data);
-    vq->descs[1].len = SECTOR_SIZE;
-    vq->descs[1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-    vq->descs[1].next = 2;
+    uint32_t start = READ_CSR(time);
+    wait_sleep(wq, &disk_lock);
+    spin_lock(&disk_lock);
+    return READ_CSR(time) - start;
+}
 
-    vq->descs[2].addr = blk_req_paddr + offsetof(struct virtio_blk_req, status);
-    vq->descs[2].len = sizeof(uint8_t);
-    vq->descs[2].flags = VIRTQ_DESC_F_WRITE;
+void virtio_blk_irq(void)
+{
+    // used ring moved, or the device wants attention for some other reason
+    virtio_reg_write32(VIRTIO_REG_INTERRUPT_ACK,
+            virtio_reg_read32(VIRTIO_REG_INTERRUPT_STATUS));
 
-    // Notify the device that there is a new request.
-    virtq_kick(vq, 0);
+    spin_lock(&disk_lock);
+    blk_reap();
+    spin_unlock(&disk_lock);
+}
 
-    // Wait until the device finishes processing.
-    while (virtq_is_busy(vq))
-        ;
+void disk_dump(void)
+{
+    spin_lock(&disk_lock);
+    uint32_t n = disk_requests ? disk_requests : 1;
+    printf("disk: %d requests, %d bytes, avg %d us latency, avg %d us CPU\n", disk_requests,
+            disk_bytes, disk_latency_ticks / n / TICKS_PER_US, disk_cpu_ticks / n / TICKS_PER_US);
+    spin_unlock(&disk_lock);
+}
+
+static struct blk_slot *blk_slot_alloc(int ndescs)
+{
+    // disk_lock held. A free request slot along with `ndescs` descriptors for it, or NULL
+    if (blk_request_vq->num_free < ndescs)
+        return NULL;
+    for (int i = 0; i < BLK_REQS_MAX; i++) {
+        if (!blk_slots[i].in_use) {
+            blk_slots[i].in_use = true;
+            blk_slots[i].done = false;
+            return &blk_slots[i];
+        }
+    }
+    return NULL;
+}
+
+int blk_rw(unsigned sector, const struct blk_seg *segs, int nsegs, bool is_write)
+{
+    // 1. Construct a request in a free blk_reqs slot. Specify the sector number, and r/w.
+    // 2. Construct a descriptor chain: the header, one per data segment, and the status.
+    // 3. Add the index of the head descriptor of the descriptor chain to the Available Ring.
+    // 4. Notify the device that there is a new pending request.
+    // 5. Sleep until the device finished processing, other procs get the CPU meanwhile.
+    //  Up to BLK_REQS_MAX requests from different procs are in flight together.
+    // 6. Check the response from the device.
+    //
+    // One request for the whole range, returns 0 or -1 if the device or the range was bad.
+    if (nsegs < 1 || nsegs > BLK_SEGS_MAX)
+        PANIC("virtio: %d segments in one request", nsegs);
+
+    uint32_t len = 0;
+    for (int i = 0; i < nsegs; i++)
+        len += segs[i].len;
+    if (!len || !is_aligned(len, SECTOR_SIZE) ||
+            sector + len / SECTOR_SIZE > blk_capacity / SECTOR_SIZE) {
+        printf("virtio: tried to read/write %d bytes at sector=%d, but capacity is %d\n",
+              len, sector, blk_capacity / SECTOR_SIZE);
+        return -1;
+    }
+
+    uint32_t start = READ_CSR(time);
+    uint32_t slept = 0;
+    spin_lock(&disk_lock);
+    struct blk_slot *slot;
+    while (!(slot = blk_slot_alloc(nsegs + 2)))
+        slept += disk_wait(&disk_slot_wait);
+
+    struct virtio_blk_req *req = &blk_reqs[slot - blk_slots];
+    paddr_t req_paddr = blk_reqs_paddr + (slot - blk_slots) * sizeof(*req);
+
+    // Construct the request according to the virtio-blk specification.
+    req->sector = sector;
+    req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+
+    // Construct the virtqueue descriptors, header first.
+    struct virtio_virtq *vq = blk_request_vq;
+    uint16_t head = virtq_desc_alloc(vq);
+    vq->descs[head].addr = req_paddr;
+    vq->descs[head].len = offsetof(struct virtio_blk_req, status);
+    vq->descs[head].flags = VIRTQ_DESC_F_NEXT;
+
+    uint16_t prev = head;
+    for (int i = 0; i < nsegs; i++) {
+        uint16_t d = virtq_desc_alloc(vq);
+        vq->descs[prev].next = d;
+        vq->descs[d].addr = segs[i].paddr;
+        vq->descs[d].len = segs[i].len;
+        vq->descs[d].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
+        prev = d;
+    }
+
+    uint16_t status = virtq_desc_alloc(vq);
+    vq->descs[prev].next = status;
+    vq->descs[status].addr = req_paddr + offsetof(struct virtio_blk_req, status);
+    vq->descs[status].len = sizeof(uint8_t);
+    vq->descs[status].flags = VIRTQ_DESC_F_WRITE;
+
+    slot->head = head;
+    blk_head_slot[head] = slot;
+
+    // Notify the device that there is a new request.
+    virtq_kick(vq, head);
+
+    // Wait until the device finishes processing.
+    for (;;) {
+        blk_reap();     // in case nobody took the interrupt yet, or we're polling
+        if (slot->done)
+            break;
+        slept += disk_wait(&slot->waiters);
+    }
 
     // virtio-blk: If a non-zero value is returned, it's an error.
-    if (blk_req->status != 0) {
+    int ret = 0;
+    if (req->status != 0) {
         printf("virtio: warn: failed to read/write sector=%d status=%d\n",
-               sector, blk_req->status);
+               sector, req->status);
+        ret = -1;
+    }
+
+    slot->in_use = false;
+    wake_all(&disk_slot_wait);      // anyone queued up for a slot
+
+    uint32_t latency = READ_CSR(time) - start;
+    disk_requests++;
+    disk_bytes += len;
+    disk_latency_ticks += latency;
+    disk_cpu_ticks += latency - slept;
+    spin_unlock(&disk_lock);
+    return ret;
+}
+
+uint32_t blk_sector_count(void)
+{
+    return blk_capacity / SECTOR_SIZE;
+}
+
+void read_write_disk(void *buf, unsigned sector, bool is_write)
+{
+    // the kernel is identity mapped, so a kernel buffer is its own physical address.
+    // Goes around the buffer cache, which mustn't be left holding a stale copy
+    bcache_invalidate(sector, 1);
+    struct blk_seg seg = { (paddr_t) buf, SECTOR_SIZE };
+    blk_rw(sector, &seg, 1, is_write);
+}
+
+/*
+ * ----------------------------------------------------------------------------------
+ * UART
+ * ----------------------------------------------------------------------------------
+ */
+
+/*
+ * Console driver. Input arrives by interrupt into a ring that readers sleep on,
+ * so nobody polls for keystrokes. Output queues in another ring and the
+ * transmitter empty interrupt keeps the FIFO fed.
+ * Ring indices run freely, head - tail is how much is queued.
+ */
+struct spinlock uart_lock;      // everything below and the device registers
+bool uart_ready;
+char uart_rx[UART_RING_SIZE];
+uint32_t uart_rx_head, uart_rx_tail;
+char uart_tx[UART_RING_SIZE];
+uint32_t uart_tx_head, uart_tx_tail;
+struct waitqueue uart_readers;  // sleeping until input arrives
+
+static uint8_t uart_reg_read(uint32_t reg)
+{
+    return *(volatile uint8_t *) (UART_PADDR + reg);
+}
+
+static void uart_reg_write(uint32_t reg, uint8_t value)
+{
+    *(volatile uint8_t *) (UART_PADDR + reg) = value;
+}
+
+void uart_init(void)
+{
+    uart_reg_write(UART_IER, 0);
+    uart_reg_write(UART_LCR, UART_LCR_DLAB);
+    uart_reg_write(UART_DLL, 3);    // 38400 baud, qemu doesn't care
+    uart_reg_write(UART_DLM, 0);
+    uart_reg_write(UART_LCR, UART_LCR_8N1);
+    uart_reg_write(UART_FCR, UART_FCR_ENABLE | UART_FCR_CLEAR);
+    uart_reg_write(UART_IER, UART_IER_RDI);
+    plic_enable(UART_IRQ);
+    uart_ready = true;
+}
+
+static void uart_tx_kick(void)
+{
+    // uart_lock held. Refills an empty FIFO from the ring, and asks for an interrupt
+    // when it empties again as long as anything is still queued
+    if (uart_reg_read(UART_LSR) & UART_LSR_THRE) {
+        for (int i = 0; i < UART_FIFO_SIZE && uart_tx_tail != uart_tx_head; i++)
+            uart_reg_write(UART_THR, uart_tx[uart_tx_tail++ % UART_RING_SIZE]);
+    }
+    uart_reg_write(UART_IER, UART_IER_RDI | (uart_tx_tail != uart_tx_head ? UART_IER_THRI : 0));
+}
+
+void uart_write(const char *buf, size_t len)
+{
+    /*
+     * Queues `len` bytes and returns. With the ring full it spins on the FIFO
+     * rather than sleeping, this is also printf() from trap handlers.
+     * The lock is dropped while spinning, so the interrupt handler and other
+     * harts aren't shut out for as long as the device takes.
+     */
+    spin_lock(&uart_lock);
+    for (size_t i = 0; i < len; i++) {
+        while (uart_tx_head - uart_tx_tail == UART_RING_SIZE) {
+            spin_unlock(&uart_lock);
+            while (!(uart_reg_read(UART_LSR) & UART_LSR_THRE))
+                ;
+            spin_lock(&uart_lock);
+            uart_tx_kick();
+        }
+        uart_tx[uart_tx_head++ % UART_RING_SIZE] = buf[i];
+    }
+    uart_tx_kick();
+    spin_unlock(&uart_lock);
+}
+
+int uart_read(char *buf, size_t len)
+{
+    /*
+     * Sleeps until at least one byte has arrived, then takes up to `len` of
+     * whatever is there. Returns how many.
+     */
+    if (!len)
+        return 0;
+
+    spin_lock(&uart_lock);
+    while (uart_rx_tail == uart_rx_head) {
+        wait_sleep(&uart_readers, &uart_lock);
+        spin_lock(&uart_lock);
+    }
+    size_t n = 0;
+    while (n < len && uart_rx_tail != uart_rx_head)
+        buf[n++] = uart_rx[uart_rx_tail++ % UART_RING_SIZE];
+    spin_unlock(&uart_lock);
+    return n;
+}
+
+void uart_irq(void)
+{
+    // input goes into the ring, overflow is dropped. Then output gets going again
+    spin_lock(&uart_lock);
+    while (uart_reg_read(UART_LSR) & UART_LSR_DR) {
+        char ch = uart_reg_read(UART_RBR);
+        if (uart_rx_head - uart_rx_tail < UART_RING_SIZE)
+            uart_rx[uart_rx_head++ % UART_RING_SIZE] = ch;
+    }
+    if (uart_rx_head != uart_rx_tail)
+        wake_all(&uart_readers);
+    uart_tx_kick();
+    spin_unlock(&uart_lock);
+}
+
+/*
+ * ----------------------------------------------------------------------------------
+ * BUFFER CACHE
+ * ----------------------------------------------------------------------------------
+ */
+
+struct spinlock bcache_lock;    // everything below, a buffer's data is covered by its own lock
+struct buf bufs[BCACHE_BUFS];
+struct buf *bcache_hash[BCACHE_HASH];
+struct buf bcache_lru;          // list head, lru_next is the most recently used
+uint32_t bcache_hits;
+uint32_t bcache_misses;
+uint32_t bcache_writebacks;
+
+static void lru_unlink(struct buf *b)
+{
+    b->lru_prev->lru_next = b->lru_next;
+    b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_push_head(struct buf *b)
+{
+    b->lru_next = bcache_lru.lru_next;
+    b->lru_prev = &bcache_lru;
+    bcache_lru.lru_next->lru_prev = b;
+    bcache_lru.lru_next = b;
+}
+
+static struct buf **bcache_bucket(uint32_t blockno)
+{
+    return &bcache_hash[blockno & (BCACHE_HASH - 1)];
+}
+
+static struct buf *bcache_find(uint32_t blockno)
+{
+    for (struct buf *b = *bcache_bucket(blockno); b; b = b->hash_next) {
+        if (b->blockno == blockno)
+            return b;
+    }
+    return NULL;
+}
+
+static void bcache_unhash(struct buf *b)
+{
+    for (struct buf **link = bcache_bucket(b->blockno); *link; link = &(*link)->hash_next) {
+        if (*link == b) {
+            *link = b->hash_next;
+            return;
+        }
+    }
+}
+
+static struct buf *bcache_victim(bool dirty_ok)
+{
+    // least recently used buffer nobody holds, clean ones only unless `dirty_ok`
+    for (struct buf *b = bcache_lru.lru_prev; b != &bcache_lru; b = b->lru_prev) {
+        if (!b->refcount && (dirty_ok || !b->dirty))
+            return b;
+    }
+    return NULL;
+}
+
+static void bcache_claim(struct buf *b, uint32_t blockno)
+{
+    // bcache_lock held, `b` is a clean victim. Returns with it locked for the caller
+    if (b->blockno != ~0u)
+        bcache_unhash(b);
+    b->blockno = blockno;
+    b->valid = false;
+    b->refcount = 1;
+    b->hash_next = *bcache_bucket(blockno);
+    *bcache_bucket(blockno) = b;
+    if (!sleep_trylock(&b->lock))
+        PANIC("bcache: unreferenced buffer %d is locked", blockno);
+}
+
+void bcache_init(void)
+{
+    paddr_t data = alloc_pages(BCACHE_BUFS * SECTOR_SIZE / PAGE_SIZE);
+    bcache_lru.lru_next = bcache_lru.lru_prev = &bcache_lru;
+    for (int i = 0; i < BCACHE_BUFS; i++) {
+        bufs[i].data = (uint8_t *) (data + i * SECTOR_SIZE);
+        bufs[i].blockno = ~0u;      // never matches, isn't hashed
+        lru_push_head(&bufs[i]);
+    }
+}
+
+static void bwrite_back(struct buf *b)
+{
+    // `b` locked by the caller
+    if (!b->dirty)
         return;
+    struct blk_seg seg = { (paddr_t) b->data, SECTOR_SIZE };
+    blk_rw(b->blockno, &seg, 1, true);
+    b->dirty = false;
+
+    spin_lock(&bcache_lock);
+    bcache_writebacks++;
+    spin_unlock(&bcache_lock);
+}
+
+static struct buf *bget(uint32_t blockno)
+{
+    // the buffer for `blockno`, locked, but possibly not read in yet
+    for (;;) {
+        spin_lock(&bcache_lock);
+        struct buf *b = bcache_find(blockno);
+        if (b) {
+            b->refcount++;
+            spin_unlock(&bcache_lock);
+            sleep_lock(&b->lock);
+            return b;
+        }
+
+        b = bcache_victim(false);
+        if (b) {
+            bcache_claim(b, blockno);
+            spin_unlock(&bcache_lock);
+            return b;
+        }
+
+        // everything free is dirty, clean the oldest and look again,
+        // someone else may have brought `blockno` in meanwhile
+        b = bcache_victim(true);
+        if (!b)
+            PANIC("bcache: all %d buffers in use", BCACHE_BUFS);
+        b->refcount++;
+        spin_unlock(&bcache_lock);
+        sleep_lock(&b->lock);
+        bwrite_back(b);
+        brelse(b);
+    }
+}
+
+static void bcache_fill(struct buf *b)
+{
+    /*
+     * Reads `b` in, along with the blocks right after it that aren't cached,
+     * up to BCACHE_READAHEAD in a single request. Read ahead only takes clean
+     * buffers, and claims them locked so nobody sees them half read.
+     */
+    struct buf *run[BCACHE_READAHEAD];
+    struct blk_seg segs[BCACHE_READAHEAD];
+    uint32_t last = blk_sector_count();
+    int n = 1;
+    run[0] = b;
+
+    spin_lock(&bcache_lock);
+    while (n < BCACHE_READAHEAD && b->blockno + n < last && !bcache_find(b->blockno + n)) {
+        struct buf *ahead = bcache_victim(false);
+        if (!ahead)
+            break;
+        bcache_claim(ahead, b->blockno + n);
+        run[n++] = ahead;
+    }
+    spin_unlock(&bcache_lock);
+
+    for (int i = 0; i < n; i++) {
+        segs[i].paddr = (paddr_t) run[i]->data;
+        segs[i].len = SECTOR_SIZE;
+    }
+    if (blk_rw(b->blockno, segs, n, false) < 0)
+        memset(b->data, 0, SECTOR_SIZE);    // past the end of the disk, reads as zeros
+
+    for (int i = 0; i < n; i++)
+        run[i]->valid = true;
+    for (int i = 1; i < n; i++)
+        brelse(run[i]);
+}
+
+struct buf *bread(uint32_t blockno)
+{
+    struct buf *b = bget(blockno);
+
+    spin_lock(&bcache_lock);
+    if (b->valid)
+        bcache_hits++;
+    else
+        bcache_misses++;
+    spin_unlock(&bcache_lock);
+
+    if (!b->valid)
+        bcache_fill(b);
+    return b;
+}
+
+void bdirty(struct buf *b)
+{
+    // `b` locked by the caller, who changed its data
+    b->dirty = true;
+}
+
+void brelse(struct buf *b)
+{
+    sleep_unlock(&b->lock);
+
+    spin_lock(&bcache_lock);
+    b->refcount--;
+    if (!b->refcount) {
+        lru_unlink(b);
+        lru_push_head(b);
+    }
+    spin_unlock(&bcache_lock);
+}
+
+void bsync(void)
+{
+    /*
+     * Writes back every dirty buffer. Runs of consecutive dirty blocks go out
+     * as one request, one segment per buffer. Buffers are locked in block order,
+     * and everyone else holds at most one at a time while waiting, so this can't deadlock.
+     */
+    for (;;) {
+        struct buf *run[BLK_SEGS_MAX];
+        struct blk_seg segs[BLK_SEGS_MAX];
+        int n = 0;
+
+        spin_lock(&bcache_lock);
+        struct buf *first = NULL;
+        for (int i = 0; i < BCACHE_BUFS; i++) {
+            if (bufs[i].dirty && (!first || bufs[i].blockno < first->blockno))
+                first = &bufs[i];
+        }
+        if (!first) {
+            spin_unlock(&bcache_lock);
+            return;
+        }
+        for (struct buf *b = first; b && b->dirty && n < BLK_SEGS_MAX;
+                b = bcache_find(first->blockno + n)) {
+            b->refcount++;
+            run[n++] = b;
+        }
+        spin_unlock(&bcache_lock);
+
+        // whoever held them may have written them back meanwhile, the run ends at the first clean one
+        int dirty = 0;
+        for (int i = 0; i < n; i++) {
+            sleep_lock(&run[i]->lock);
+            if (dirty == i && run[i]->dirty) {
+                segs[dirty].paddr = (paddr_t) run[i]->data;
+                segs[dirty].len = SECTOR_SIZE;
+                dirty++;
+            }
+        }
+        if (dirty)
+            blk_rw(run[0]->blockno, segs, dirty, true);
+        for (int i = 0; i < dirty; i++)
+            run[i]->dirty = false;
+
+        spin_lock(&bcache_lock);
+        bcache_writebacks += dirty;
+        spin_unlock(&bcache_lock);
+        for (int i = 0; i < n; i++)
+            brelse(run[i]);
+    }
+}
+
+void bcache_invalidate(uint32_t blockno, uint32_t count)
+{
+    // before raw I/O on these blocks: dirty data goes out first, and cached copies get reread
+    for (uint32_t i = 0; i < count; i++) {
+        spin_lock(&bcache_lock);
+        struct buf *b = bcache_find(blockno + i);
+        if (!b) {
+            spin_unlock(&bcache_lock);
+            continue;
+        }
+        b->refcount++;
+        spin_unlock(&bcache_lock);
+
+        sleep_lock(&b->lock);
+        bwrite_back(b);
+        b->valid = false;
+        brelse(b);
     }
+}
 
-    // For read operations, copy the data into the buffer.
-    if (!is_write)
-        memcpy(buf, blk_req->data, SECTOR_SIZE);
+void bcache_dump(void)
+{
+    spin_lock(&bcache_lock);
+    uint32_t dirty = 0;
+    for (int i = 0; i < BCACHE_BUFS; i++)
+        dirty += bufs[i].dirty;
+    printf("bcache: %d hits, %d misses, %d writebacks, %d/%d buffers dirty\n",
+            bcache_hits, bcache_misses, bcache_writebacks, dirty, BCACHE_BUFS);
+    spin_unlock(&bcache_lock);
 }
 
 /*
@@ -355,8 +1542,16 @@ void read_write_disk(void *buf, unsigned sector, bool is_write)
  * ----------------------------------------------------------------------------------
  */
 
-struct file files[FILES_MAX];
-uint8_t disk[DISK_MAX_SIZE];
+struct sleeplock fs_lock;
+struct file **files;    // index of every archive entry, grows by doubling
+struct file **files_hash;       // same entries chained by name, files_capacity buckets
+uint32_t files_capacity;
+uint32_t files_count;
+struct file *file_chunk;        // file structs are carved out of pages and never move
+uint32_t file_chunk_left;
+uint32_t fs_end;        // tar: first sector past the last archive entry, where the end marker starts
+struct ashfs_super fs_super;    // ashfs: copy of the superblock
+uint32_t ashfs_alloc_hint;      // ashfs: where the search for free sectors picks up
 
 int oct2int(char *oct, int len)
 {
@@ -370,87 +1565,526 @@ int oct2int(char *oct, int len)
     return dec;
 }
 
-void fs_init(void)
+static uint32_t fs_entry_sectors(uint32_t size)
+{
+    // header plus data, which is how far apart tar entries are
+    return 1 + align_up(size, SECTOR_SIZE) / SECTOR_SIZE;
+}
+
+static uint32_t fs_name_hash(const char *name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*name)
+        hash = (hash ^ (uint8_t) *name++) * 16777619u;
+    return hash;
+}
+
+static struct file **fs_bucket(const char *name)
+{
+    return &files_hash[fs_name_hash(name) & (files_capacity - 1)];
+}
+
+static struct file *file_alloc(const char *name)
 {
     /*
-     * Initializes by directly loading each file in archive into memory.
+     * A zeroed file called `name`, added to the index. The hash table has as many
+     * buckets as the index has slots, so both double together and chains stay
+     * shorter than one entry on average.
+     * `name` may be a tar header's, which isn't NUL terminated when it's full.
      */
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, false);
+    if (!file_chunk_left) {
+        file_chunk = (struct file *) alloc_pages(1);
+        file_chunk_left = PAGE_SIZE / sizeof(struct file);
+    }
+    struct file *file = file_chunk++;
+    file_chunk_left--;
+    size_t len = 0;
+    while (len < FS_NAME_MAX && name[len])
+        len++;
+    memcpy(file->name, name, len);
+    file->name[len] = '\0';
+
+    if (files_count == files_capacity) {
+        uint32_t old_pages = align_up(files_capacity * sizeof(struct file *), PAGE_SIZE) / PAGE_SIZE;
+        uint32_t capacity = files_capacity ? files_capacity * 2 : FILES_INIT;
+        uint32_t table_pages = align_up(capacity * sizeof(struct file *), PAGE_SIZE) / PAGE_SIZE;
+        struct file **table = (struct file **) alloc_pages(table_pages);
+        struct file **hash = (struct file **) alloc_pages(table_pages);
+        if (files) {
+            memcpy(table, files, files_count * sizeof(struct file *));
+            free_pages((paddr_t) files, pages_to_order(old_pages));
+            free_pages((paddr_t) files_hash, pages_to_order(old_pages));
+        }
+        files = table;
+        files_hash = hash;
+        files_capacity = capacity;
+        for (uint32_t i = 0; i < files_count; i++) {
+            struct file **bucket = fs_bucket(files[i]->name);
+            files[i]->hash_next = *bucket;
+            *bucket = files[i];
+        }
+    }
+    files[files_count++] = file;
+    struct file **bucket = fs_bucket(file->name);
+    file->hash_next = *bucket;
+    *bucket = file;
+    return file;
+}
 
-    unsigned off = 0;
-    for (int i = 0; i < FILES_MAX; i++) {
-        struct tar_header *header = (struct tar_header *) &disk[off];
-        if (header->name[0] == '\0')
+static void tar_mount(void)
+{
+    /*
+     * Scans a tar archive and indexes every entry by name. Only headers are read,
+     * contents come in through the buffer cache as they're used, so mounting costs
+     * one sector per file however big the files are.
+     */
+    uint32_t sector = 0;
+    uint32_t last = blk_sector_count();
+    while (sector < last) {
+        struct buf *b = bread(sector);
+        struct tar_header *header = (struct tar_header *) b->data;
+        if (header->name[0] == '\0') {
+            brelse(b);
             break;
+        }
 
         if (strcmp(header->magic, "ustar") != 0)
             PANIC("invalid tar header: magic=\"%s\"", header->magic);
 
         int filesz = oct2int(header->size, sizeof(header->size));
+        uint32_t entry_sectors = fs_entry_sectors(filesz);
+        if (strcmp(header->name, FS_HOLE_NAME)) {
+            // holes are space left behind by a file that moved, see tar_resize()
+            struct file *file = file_alloc(header->name);
+            file->in_use = true;
+            file->size = filesz;
+            file->sector = sector;
+            file->nsectors = entry_sectors;
+        }
+        brelse(b);
+        sector += entry_sectors;
+    }
+    fs_end = sector;
+    printf("fs: tar, %d files, archive is %d sectors\n", files_count, fs_end);
+}
+
+static void fs_zero_sector(uint32_t sector, uint32_t from)
+{
+    // zeroes the sector from byte `from` on
+    struct buf *b = bread(sector);
+    memset(b->data + from, 0, SECTOR_SIZE - from);
+    bdirty(b);
+    brelse(b);
+}
 
-        struct file *file = &files[i];
-        file->in_use = true;
-        strcpy(file->name, header->name);
-        memcpy(file->data, header->data, filesz);
-        file->size = filesz;
-        printf("file: %s, size=%d\n", file->name, file->size);
+static void fs_copy_sector(uint32_t dst, uint32_t src)
+{
+    struct buf *from = bread(src);
+    struct buf *to = bread(dst);
+    memcpy(to->data, from->data, SECTOR_SIZE);
+    bdirty(to);
+    brelse(to);
+    brelse(from);
+}
 
-        off += align_up(sizeof(struct tar_header) + filesz, SECTOR_SIZE);
+static void fs_write_header(uint32_t sector, const char *name, uint32_t size)
+{
+    struct buf *b = bread(sector);
+    struct tar_header *header = (struct tar_header *) b->data;
+    memset(header, 0, sizeof(*header));
+    strcpy(header->name, name);
+    strcpy(header->mode, "000644");
+    strcpy(header->magic, "ustar");
+    strcpy(header->version, "00");
+    header->type = '0';
+
+    // turn into octal string
+    int filesz = size;
+    for (int i = sizeof(header->size); i > 0; i--) {
+        header->size[i - 1] = (filesz % 8) + '0';
+        filesz /= 8;
     }
+
+    // calculate checksum
+    int checksum = ' ' * sizeof(header->checksum);
+    for (unsigned i = 0; i < sizeof(struct tar_header); i++)
+        checksum += b->data[i];
+    for (int i = 5; i >= 0; i--) {
+        header->checksum[i] = (checksum % 8) + '0';
+        checksum /= 8;
+    }
+
+    bdirty(b);
+    brelse(b);
 }
 
-void fs_flush(void)
+static void fs_write_hole(uint32_t sector, uint32_t nsectors)
+{
+    // turns `nsectors` no file owns anymore into an entry readers skip over
+    fs_write_header(sector, FS_HOLE_NAME, (nsectors - 1) * SECTOR_SIZE);
+}
+
+static int tar_resize(struct file *file, uint32_t size)
+{
+    /*
+     * Makes the file's entry fit `size` bytes. A file that still fits keeps its place,
+     * any sectors it stopped needing become a hole. The last file in the archive
+     * grows into the end marker, any other that outgrew its entry is copied to the end
+     * of the archive and leaves a hole behind.
+     * Returns -1 if the disk is full.
+     */
+    uint32_t needed = fs_entry_sectors(size);
+    if (needed > file->nsectors) {
+        bool last = file->sector + file->nsectors == fs_end;
+        uint32_t sector = last ? file->sector : fs_end;
+        if (sector + needed + 1 > blk_sector_count()) {
+            printf("fs: no room to grow %s to %d bytes\n", file->name, size);
+            return -1;
+        }
+
+        if (!last) {
+            for (uint32_t i = 1; i < file->nsectors; i++)
+                fs_copy_sector(sector + i, file->sector + i);
+            fs_write_hole(file->sector, file->nsectors);
+            file->sector = sector;
+        }
+        for (uint32_t i = file->nsectors; i < needed; i++)
+            fs_zero_sector(sector + i, 0);
+        file->nsectors = needed;
+        fs_end = sector + needed;
+        fs_zero_sector(fs_end, 0);      // end of archive marker moves along
+    } else if (needed < file->nsectors) {
+        fs_write_hole(file->sector + needed, file->nsectors - needed);
+        file->nsectors = needed;
+    }
+    return 0;
+}
+
+static uint32_t extent_sector(const struct ashfs_extent *extents, uint32_t nextents, uint32_t n)
+{
+    // disk sector holding data sector `n` of an extent list
+    for (uint32_t i = 0; i < nextents; i++) {
+        if (n < extents[i].len)
+            return extents[i].start + n;
+        n -= extents[i].len;
+    }
+    PANIC("sector %d is past the last extent", n);
+}
+
+static uint32_t fs_bmap(struct file *file, uint32_t n)
+{
+    // disk sector holding the file's `n`th data sector
+    if (!file->ino)
+        return file->sector + 1 + n;
+    return extent_sector(file->extents, file->nextents, n);
+}
+
+static void ashfs_read_inode(uint32_t ino, struct ashfs_inode *inode)
+{
+    struct buf *b = bread(fs_super.inode_start + ino / ASHFS_INODES_PER_SECTOR);
+    memcpy(inode, b->data + (ino % ASHFS_INODES_PER_SECTOR) * sizeof(*inode), sizeof(*inode));
+    brelse(b);
+}
+
+static void ashfs_write_file_inode(struct file *file)
+{
+    // the in-memory size and extents go back to the inode, one sector dirtied
+    struct buf *b = bread(fs_super.inode_start + file->ino / ASHFS_INODES_PER_SECTOR);
+    struct ashfs_inode *inode = (struct ashfs_inode *)
+            (b->data + (file->ino % ASHFS_INODES_PER_SECTOR) * sizeof(*inode));
+    inode->size = file->size;
+    inode->nextents = file->nextents;
+    memcpy(inode->extents, file->extents, sizeof(inode->extents));
+    bdirty(b);
+    brelse(b);
+}
+
+static bool ashfs_taken(uint32_t sector)
+{
+    struct buf *b = bread(fs_super.bitmap_start + sector / ASHFS_BITS_PER_SECTOR);
+    uint32_t bit = sector % ASHFS_BITS_PER_SECTOR;
+    bool taken = b->data[bit / 8] & (1 << (bit % 8));
+    brelse(b);
+    return taken;
+}
+
+static void ashfs_mark(uint32_t sector, bool taken)
 {
-    // copy file contents to disk buffer
-    memset(disk, 0, sizeof(disk));
-    unsigned off = 0;
-    for (int file_i = 0; file_i < FILES_MAX; file_i++) {
-        struct file *file = &files[file_i];
-        if (!file->in_use)
+    struct buf *b = bread(fs_super.bitmap_start + sector / ASHFS_BITS_PER_SECTOR);
+    uint32_t bit = sector % ASHFS_BITS_PER_SECTOR;
+    if (taken)
+        b->data[bit / 8] |= 1 << (bit % 8);
+    else
+        b->data[bit / 8] &= ~(1 << (bit % 8));
+    bdirty(b);
+    brelse(b);
+}
+
+static uint32_t ashfs_alloc(uint32_t want, uint32_t *got)
+{
+    /*
+     * Takes a run of free sectors, up to `want` long, searching from ashfs_alloc_hint
+     * and wrapping around once. Returns its first sector and its length in `got`,
+     * or 0 when the disk is full (sector 0 is the superblock, never free).
+     */
+    uint32_t data_sectors = fs_super.nsectors - fs_super.data_start;
+    for (uint32_t i = 0; i < data_sectors; i++) {
+        uint32_t start = fs_super.data_start
+                + (ashfs_alloc_hint - fs_super.data_start + i) % data_sectors;
+        if (ashfs_taken(start))
             continue;
 
-        struct tar_header *header = (struct tar_header *) &disk[off];
-        memset(header, 0, sizeof(*header));
-        strcpy(header->name, file->name);
-        strcpy(header->mode, "000644");
-        strcpy(header->magic, "ustar");
-        strcpy(header->version, "00");
-        header->type = '0';
-
-        // turn into octal string
-        int filesz = file->size;
-        for (int i = sizeof(header->size); i > 0; i--) {
-            header->size[i - 1] = (filesz % 8) + '0';
-            filesz /= 8;
+        uint32_t len = 1;
+        while (len < want && start + len < fs_super.nsectors && !ashfs_taken(start + len))
+            len++;
+        for (uint32_t j = 0; j < len; j++)
+            ashfs_mark(start + j, true);
+
+        ashfs_alloc_hint = start + len < fs_super.nsectors ? start + len : fs_super.data_start;
+        *got = len;
+        return start;
+    }
+    return 0;
+}
+
+static void ashfs_shrink(struct file *file, uint32_t nsectors)
+{
+    // frees the file's data sectors past the first `nsectors`
+    while (file->nsectors > nsectors) {
+        struct ashfs_extent *last = &file->extents[file->nextents - 1];
+        uint32_t drop = file->nsectors - nsectors;
+        if (drop > last->len)
+            drop = last->len;
+
+        for (uint32_t i = 0; i < drop; i++)
+            ashfs_mark(last->start + last->len - 1 - i, false);
+        last->len -= drop;
+        file->nsectors -= drop;
+        if (!last->len)
+            file->nextents--;
+    }
+}
+
+static int ashfs_resize(struct file *file, uint32_t size)
+{
+    /*
+     * Allocates or frees data sectors so `size` bytes fit. Growth extends the last
+     * extent while the sectors right after it are free, and takes new extents from
+     * the bitmap otherwise. Only bitmap and new data sectors are touched here,
+     * the inode goes out with fs_flush().
+     * Returns -1, with the file as it was, if the disk is full or the file would
+     * need more than ASHFS_EXTENTS extents.
+     */
+    uint32_t needed = align_up(size, SECTOR_SIZE) / SECTOR_SIZE;
+    uint32_t old_nsectors = file->nsectors;
+    while (file->nsectors < needed) {
+        struct ashfs_extent *last = file->nextents ? &file->extents[file->nextents - 1] : NULL;
+        uint32_t sector, got;
+        if (last && last->start + last->len < fs_super.nsectors
+                && !ashfs_taken(last->start + last->len)) {
+            sector = last->start + last->len;
+            ashfs_mark(sector, true);
+            last->len++;
+            got = 1;
+        } else if (file->nextents < ASHFS_EXTENTS
+                && (sector = ashfs_alloc(needed - file->nsectors, &got))) {
+            file->extents[file->nextents].start = sector;
+            file->extents[file->nextents].len = got;
+            file->nextents++;
+        } else {
+            printf("fs: no room to grow %s to %d bytes\n", file->name, size);
+            ashfs_shrink(file, old_nsectors);
+            return -1;
         }
 
-        // calculate checksum
-        int checksum = ' ' * sizeof(header->checksum);
-        for (unsigned i = 0; i < sizeof(struct tar_header); i++)
-            checksum += (unsigned char) disk[off + i];
-        for (int i = 5; i >= 0; i--) {
-            header->checksum[i] = (checksum % 8) + '0';
-            checksum /= 8;
+        for (uint32_t i = 0; i < got; i++)
+            fs_zero_sector(sector + i, 0);
+        file->nsectors += got;
+    }
+    ashfs_shrink(file, needed);
+    return 0;
+}
+
+static void ashfs_scan_dir(uint32_t ino, const char *prefix)
+{
+    /*
+     * Indexes every file under directory `ino` by its full path. `prefix` is the
+     * directory's own path, with a trailing slash unless it is the root.
+     */
+    struct ashfs_inode dir;
+    ashfs_read_inode(ino, &dir);
+    uint32_t prefix_len = strlen(prefix);
+    for (uint32_t i = 0; i < dir.size / sizeof(struct ashfs_dirent); i++) {
+        struct ashfs_dirent dirent;
+        struct buf *b = bread(extent_sector(dir.extents, dir.nextents, i / ASHFS_DIRENTS_PER_SECTOR));
+        memcpy(&dirent, b->data + (i % ASHFS_DIRENTS_PER_SECTOR) * sizeof(dirent), sizeof(dirent));
+        brelse(b);
+        if (!dirent.ino)
+            continue;
+
+        char path[sizeof(((struct file *) 0)->name)];
+        dirent.name[ASHFS_NAME_MAX - 1] = '\0';
+        if (prefix_len + strlen(dirent.name) + 2 > sizeof(path)) {
+            printf("fs: path too long, skipping %s%s\n", prefix, dirent.name);
+            continue;
+        }
+        strcpy(path, prefix);
+        strcpy(path + prefix_len, dirent.name);
+
+        struct ashfs_inode inode;
+        ashfs_read_inode(dirent.ino, &inode);
+        if (inode.type == ASHFS_T_DIR) {
+            strcpy(path + strlen(path), "/");
+            ashfs_scan_dir(dirent.ino, path);
+        } else if (inode.type == ASHFS_T_FILE) {
+            struct file *file = file_alloc(path);
+            file->in_use = true;
+            file->size = inode.size;
+            file->ino = dirent.ino;
+            file->nextents = inode.nextents;
+            memcpy(file->extents, inode.extents, sizeof(file->extents));
+            for (uint32_t e = 0; e < file->nextents; e++)
+                file->nsectors += file->extents[e].len;
         }
+    }
+}
+
+static void ashfs_mount(void)
+{
+    /*
+     * Walks the directory tree once and indexes files by path, so fs_lookup()
+     * works the same as on a tar disk. Like there, contents aren't read until used.
+     */
+    if (fs_super.nsectors > blk_sector_count())
+        PANIC("ashfs is %d sectors, the disk only %d", fs_super.nsectors, blk_sector_count());
+
+    ashfs_alloc_hint = fs_super.data_start;
+    ashfs_scan_dir(ASHFS_ROOT_INO, "");
+    printf("fs: ashfs, %d files on %d sectors\n", files_count, fs_super.nsectors);
+}
+
+void fs_init(void)
+{
+    // sector 0 is either an ashfs superblock or the first tar header
+    struct buf *b = bread(0);
+    memcpy(&fs_super, b->data, sizeof(fs_super));
+    brelse(b);
+
+    if (fs_super.magic == ASHFS_MAGIC)
+        ashfs_mount();
+    else
+        tar_mount();
+}
 
-        // copy file data
-        memcpy(header->data, file->data, file->size);
-        off += align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE);
+static int fs_resize(struct file *file, uint32_t size)
+{
+    // makes room for `size` bytes, bytes past the old size read as zeros. -1 if the disk is full
+    uint32_t old_size = file->size;
+    if ((file->ino ? ashfs_resize(file, size) : tar_resize(file, size)) < 0)
+        return -1;
+
+    if (size > old_size && old_size % SECTOR_SIZE)
+        fs_zero_sector(fs_bmap(file, old_size / SECTOR_SIZE), old_size % SECTOR_SIZE);
+    file->size = size;
+    file->dirty = true;
+    return 0;
+}
+
+int fs_read(struct file *file, uint32_t off, void *buf, uint32_t len)
+{
+    // up to `len` bytes from `off` out to user memory, returns how many there were or -1
+    if (off >= file->size)
+        return 0;
+    if (len > file->size - off)
+        len = file->size - off;
+
+    for (uint32_t done = 0; done < len; ) {
+        uint32_t pos = off + done;
+        uint32_t in_sector = pos % SECTOR_SIZE;
+        uint32_t n = SECTOR_SIZE - in_sector;
+        if (n > len - done)
+            n = len - done;
+
+        struct buf *b = bread(fs_bmap(file, pos / SECTOR_SIZE));
+        int ret = copy_to_user((uint8_t *) buf + done, b->data + in_sector, n);
+        brelse(b);
+        if (ret < 0)
+            return -1;
+        done += n;
     }
+    return len;
+}
 
-    // write `disk` buffer into virtio-blk
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, true);
+int fs_write(struct file *file, uint32_t off, const void *buf, uint32_t len)
+{
+    /*
+     * `len` bytes of user memory at `off`, growing the file as needed.
+     * Returns len, or -1 if the disk is full or `buf` isn't valid.
+     * If `buf` goes bad partway, returns how much made it in before that.
+     * Writing nothing leaves the file alone, even past its end.
+     */
+    if (!len)
+        return 0;
+    if (off + len > file->size && fs_resize(file, off + len) < 0)
+        return -1;
+
+    for (uint32_t done = 0; done < len; ) {
+        uint32_t pos = off + done;
+        uint32_t in_sector = pos % SECTOR_SIZE;
+        uint32_t n = SECTOR_SIZE - in_sector;
+        if (n > len - done)
+            n = len - done;
+
+        struct buf *b = bread(fs_bmap(file, pos / SECTOR_SIZE));
+        int ret = copy_from_user(b->data + in_sector, (const uint8_t *) buf + done, n);
+        bdirty(b);
+        brelse(b);
+        if (ret < 0)
+            return done ? (int) done : -1;
+        done += n;
+    }
+    return len;
+}
 
-    printf("wrote %d ytes to disk\n", sizeof(disk));
+int fs_truncate(struct file *file, uint32_t size)
+{
+    return fs_resize(file, size);
+}
+
+void fs_commit(struct file *file)
+{
+    // a dirty file's header or inode goes into the buffer cache, the disk sees it on the next bsync()
+    if (!file->dirty)
+        return;
+    if (file->ino)
+        ashfs_write_file_inode(file);
+    else
+        fs_write_header(file->sector, file->name, file->size);
+    file->dirty = false;
+}
+
+void fs_flush(void)
+{
+    /*
+     * Data already went into the buffer cache as it was written, dirty files just
+     * need their header or inode to catch up. Then everything dirty goes out, only
+     * sectors that were actually touched.
+     */
+    for (uint32_t i = 0; i < files_count; i++) {
+        if (files[i]->in_use)
+            fs_commit(files[i]);
+    }
+    bsync();
 }
 
 struct file *fs_lookup(const char *filename)
 {
-    for (int i = 0; i < FILES_MAX; i++) {
-        struct file *file = &files[i];
-        if (!strcmp(file->name, filename))
+    if (!files_count)
+        return NULL;
+
+    for (struct file *file = *fs_bucket(filename); file; file = file->hash_next) {
+        if (file->in_use && !strcmp(file->name, filename))
             return file;
     }
 
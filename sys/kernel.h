@@ -1,25 +1,115 @@
 #pragma once
 #include "../common.h"
+#include "ashfs.h"
 
 /*
  * kernel panics!
  * wrapped in a `do while(0)` -- executes once and can more easily be deployed
  * gives source file name (__FILE__) and line (__LINE__)
  * macro allows for multiple arguments with ##__VA_ARGS__
+ * output goes around the UART driver through SBI, this hart may hold uart_lock
  */
 #define PANIC(fmt, ...)                                                         \
     do {                                                                        \
+        uart_ready = false;                                                     \
         printf("PANIC: %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__);   \
         while (1) {}                                                            \
     } while (0)                                                                 \
 
+/*
+ * --------------------------------------------------------------------------------
+ * SYNCHRONIZATION
+ * --------------------------------------------------------------------------------
+ */
+
+/*
+ * The kernel always runs with S-Mode interrupts off (only idle_wait() turns them on),
+ * so spinlocks don't have to mask anything, they just keep the other harts out.
+ */
+struct spinlock {
+    volatile uint32_t locked;
+};
+
+void spin_lock(struct spinlock *lock);
+void spin_unlock(struct spinlock *lock);
+
+/*
+ * Procs blocked until some event happens, woken first come first served.
+ * Whatever spinlock guards the event guards its queue too, it's held around
+ * wait_sleep() and the wakes. Linked through rq_next.
+ */
+struct waitqueue {
+    struct proc *head;
+    struct proc *tail;
+};
+
+void wait_sleep(struct waitqueue *wq, struct spinlock *lock);
+void wake_one(struct waitqueue *wq);
+void wake_all(struct waitqueue *wq);
+
+/*
+ * For long critical sections that may wait on I/O. Waiters sleep instead of spinning,
+ * so the holder can block without wedging whoever wants the lock next.
+ * Only procs can take one, not the idle proc.
+ */
+struct sleeplock {
+    struct spinlock guard;      // protects the fields below
+    bool locked;
+    struct waitqueue sleepers;
+};
+
+void sleep_lock(struct sleeplock *lock);
+bool sleep_trylock(struct sleeplock *lock);
+void sleep_unlock(struct sleeplock *lock);
+
 /*
  * --------------------------------------------------------------------------------
  * MEMORY MANAGEMENT
  * --------------------------------------------------------------------------------
  */
 
+/*
+ * Buddy allocator over __free_ram..__free_ram_end.
+ * Blocks are 2^order pages, and every page in the managed region
+ * has a `struct page` entry in a table carved out of the front of free RAM.
+ * Only the first page of a block carries meaningful order/flags.
+ */
+#define PAGE_ORDER_MAX  14          // 2^14 pages == 64MB, matches kernel.ld
+
+#define PG_FREE         (1 << 0)    // page heads a block sitting on a free list
+
+struct page {
+    struct page *next;      // free list links, only valid while PG_FREE is set
+    struct page *prev;
+    uint8_t order;
+    uint8_t flags;
+    uint16_t refcount;      // mappings sharing this block, e.g. after a COW fork
+};
+
+struct free_area {
+    struct page *head;
+    uint32_t count;         // number of free blocks of this order
+};
+
+/*
+ * Order-0 pages zeroed ahead of time while the kernel has nothing better to do.
+ * Zeroed allocations pop from here first and only memset on a miss.
+ */
+#define ZERO_POOL_MAX   64
+#define ZERO_POOL_BATCH 8           // pages zeroed per refill call, bounds idle latency
+
+#define ALLOC_NOZERO    (1 << 0)    // caller overwrites the whole block anyway
+
+void mem_init(void);
 paddr_t alloc_pages(uint32_t n);    // paddr_t from common.h
+paddr_t alloc_pages_flags(uint32_t n, uint32_t flags);
+void zero_pool_refill(void);
+void free_pages(paddr_t paddr, uint32_t order);
+uint32_t pages_to_order(uint32_t n);
+void page_ref(paddr_t paddr);
+void page_unref(paddr_t paddr);
+uint32_t page_refcount(paddr_t paddr);
+void mem_dump(void);
 
 /*
  * ----------------------------------------------------------------------------------
@@ -27,18 +117,109 @@ paddr_t alloc_pages(uint32_t n);    // paddr_t from common.h
  * ----------------------------------------------------------------------------------
  */
 
-#define PROCS_MAX       8
+#define PROCS_MAX       1024        // hard cap, the table itself grows as needed
+#define PROCS_INIT      8           // initial capacity of the proc table
+#define PROC_PAGES      2           // each proc (and its kernel stack) is one 2^1 page block
+
+/*
+ * Run queues. One FIFO per priority level, 0 being the most important,
+ * plus a bitmap of which levels are non-empty so picking the next proc
+ * is a count-trailing-zeros rather than a scan. Only runnable procs that
+ * aren't currently on the CPU are queued, and the idle proc never is.
+ */
+#define PRIO_LEVELS     8
+#define PRIO_DEFAULT    4
+
+struct runqueue {
+    struct spinlock lock;
+    struct proc *heads[PRIO_LEVELS];
+    struct proc *tails[PRIO_LEVELS];
+    uint32_t bitmap;            // bit n set if heads[n] isn't empty
+};
+
+/*
+ * Per hart state. Each hart has its own run queue and idle proc,
+ * and pulls work from the others' queues when its own runs dry.
+ * The arch keeps a pointer to the running hart's `struct cpu` handy for this_cpu().
+ */
+#define HARTS_MAX       4
+
+struct cpu {
+    uint32_t hartid;
+    struct proc *current_proc;
+    struct proc *idle_proc;
+    struct proc *prev_proc;     // proc being switched away from, see finish_switch()
+    struct runqueue rq;
+    uint32_t asid_generation;   // ASID generation this hart's TLB was last flushed for
+};
+
+extern struct cpu cpus[HARTS_MAX];
+
+// this_cpu() comes from the arch header
+#define current_proc    (this_cpu()->current_proc)
+#define idle_proc       (this_cpu()->idle_proc)
+
+/*
+ * Preemption. Every proc gets TIME_SLICE_MS of CPU before the timer
+ * interrupt forces a yield(). Override with e.g. `make CFLAGS+=-DTIME_SLICE_MS=5`,
+ * or change `time_slice_ticks` at runtime.
+ */
+#ifndef TIME_SLICE_MS
+#define TIME_SLICE_MS   10
+#endif
+#define TIMER_FREQ      10000000    // qemu virt timebase-frequency, 10MHz
+#define TICKS_PER_MS    (TIMER_FREQ / 1000)
+#define TICKS_PER_US    (TIMER_FREQ / 1000000)
+
+extern uint32_t time_slice_ticks;
+
+#define FDS_MAX         16          // open files per proc
+
+// an open file or the console. fork() copies these, so parent and child seek independently
+struct fd {
+    enum fd_type { FD_NONE, FD_FILE, FD_CONSOLE } type;
+    struct file *file;
+    uint32_t offset;
+    int flags;                  // as passed to open()
+};
 
 struct proc {
     int pid;
-    enum proc_state { UNUSED, RUNNABLE, EXITED } state;
+    enum proc_state { UNUSED, RUNNABLE, BLOCKED, EXITED } state;
+    int priority;
+    struct proc *rq_next;       // next in the run queue, a wait queue while blocked, or the free list once exited
+    volatile bool on_cpu;       // a hart is running it, or still saving its registers
+    uint32_t last_hart;         // hart it last ran on, its TLB entries elsewhere may be stale
     vaddr_t sp;
     uint32_t *page_table;
-    uint8_t kern_stack[8192];   // user's GPRs, ret addr, etc, as well as kernel's vars
+    uint32_t asid;              // TLB tag, only valid while asid_gen is the current generation
+    uint32_t asid_gen;
+    const uint8_t *image;       // backing for demand paged user memory, see demand_page()
+    size_t image_size;
+
+    // accounting, all times in microseconds (wraps after ~71 minutes)
+    uint32_t run_start;         // timer ticks when last switched in
+    uint32_t ready_since;       // timer ticks when it last became runnable without running
+    uint32_t runtime_us;
+    uint32_t max_wait_us;       // longest time spent runnable but waiting for the CPU
+    uint32_t nr_switches;       // times switched in
+    uint32_t nr_preempted;      // times the timer kicked it off the CPU
+    struct fd fds[FDS_MAX];
+    uint8_t kern_stack[7680];   // user's GPRs, ret addr, etc, as well as kernel's vars
+                                // sized so the whole proc fits in PROC_PAGES
 };
 
 struct proc *init_proc(const void* image, size_t image_size);
+struct trap_frame;  // arch specific, see riscv.h
+int fork_proc(struct trap_frame *frame, uint32_t user_pc);
+bool demand_page(struct proc *proc, vaddr_t vaddr);
 void yield(void);
+void sleep(struct spinlock *lock);
+void wakeup(struct proc *proc);
+void finish_switch(void);
+void proc_dump(void);
+void console_write(const char *buf, size_t len);
+void secondary_main(uint32_t hartid);
 
 /*
  * ----------------------------------------------------------------------------------
@@ -47,6 +228,7 @@ void yield(void);
  */
 
 #define USER_BASE 0x1000000     // needs to match userspace.ld
+#define USER_END  0x02000000    // exclusive, also in userspace.ld. CLINT, the lowest MMIO above USER_BASE on qemu virt, starts here
 #define SSTATUS_SPIE (1 << 5)   // sstatus register SPIE bit controls U-Mode
 #define SSTATUS_SUM  (1 << 18)  // SUM bit allows for supervisor to read user memory
 
@@ -63,6 +245,7 @@ void yield(void);
 #define VIRTIO_DEVICE_BLK               2
 
 #define VIRTIO_BLK_PADDR                0x10001000
+#define VIRTIO_BLK_IRQ                  1       // qemu virt, virtio-mmio slot 0
 #define VIRTIO_REG_MAGIC                0x00
 #define VIRTIO_REG_VERSION              0x04
 #define VIRTIO_REG_DEVICE_ID            0x08
@@ -73,6 +256,8 @@ void yield(void);
 #define VIRTIO_REG_QUEUE_PFN            0x40
 #define VIRTIO_REG_QUEUE_READY          0x44
 #define VIRTIO_REG_QUEUE_NOTIFY         0x50
+#define VIRTIO_REG_INTERRUPT_STATUS     0x60
+#define VIRTIO_REG_INTERRUPT_ACK        0x64
 #define VIRTIO_REG_DEVICE_STATUS        0x70
 #define VIRTIO_REG_DEVICE_CONFIG        0x100
 
@@ -123,27 +308,135 @@ struct virtio_virtq {
     struct virtq_used used __attribute__((aligned(PAGE_SIZE)));
     int queue_index;
     volatile uint16_t *used_index;
-    uint16_t last_used_index;
+    uint16_t last_used_index;   // used ring entries reaped so far
+    uint16_t free_head;         // unused descriptors, chained through `next`
+    uint16_t num_free;
 } __attribute__((packed));
 
+// just the header and status, data descriptors point straight at the caller's buffers
 struct virtio_blk_req {
     uint32_t type;
     uint32_t reserved;
     uint64_t sector;
-    uint8_t data[512];
     uint8_t status;
 } __attribute__((packed));
 
+/*
+ * Requests in flight at once. A single segment request takes a 3 descriptor chain
+ * (header, data, status), so that's as many as the ring fits.
+ * Multi-segment ones take more, and fewer of them fit.
+ */
+#define BLK_REQS_MAX    (VIRTQ_ENTRY_NUM / 3)
+
+// driver side bookkeeping for one of the blk_reqs slots
+struct blk_slot {
+    bool in_use;
+    bool done;              // the device put it on the used ring
+    uint16_t head;          // first descriptor of its chain, the used ring's `id`
+    struct waitqueue waiters;   // procs sleeping until it's done
+};
+
+/*
+ * A physically contiguous piece of a transfer. blk_rw() turns a list of them
+ * into one request, one data descriptor each, so the device DMAs straight in/out of them.
+ * Lengths have to add up to whole sectors.
+ */
+struct blk_seg {
+    paddr_t paddr;
+    uint32_t len;
+};
+
+#define BLK_SEGS_MAX    (VIRTQ_ENTRY_NUM - 2)   // rest of the ring after the header and status
+
+int blk_rw(unsigned sector, const struct blk_seg *segs, int nsegs, bool is_write);
+void read_write_disk(void *buf, unsigned sector, bool is_write);    // `buf` in kernel memory
+uint32_t blk_sector_count(void);
+void virtio_blk_irq(void);
+void disk_dump(void);
+
+/*
+ * ----------------------------------------------------------------------------------
+ * UART
+ * ----------------------------------------------------------------------------------
+ */
+
+// ns16550a on qemu virt, the same one OpenSBI's console drives
+#define UART_PADDR          0x10000000  // shares its megapage with virtio-mmio
+#define UART_IRQ            10
+#define UART_RBR            0           // receive buffer, read
+#define UART_THR            0           // transmit holding, write
+#define UART_DLL            0           // divisor latch, while LCR_DLAB is set
+#define UART_DLM            1
+#define UART_IER            1
+#define UART_FCR            2
+#define UART_LCR            3
+#define UART_LSR            5
+
+#define UART_IER_RDI        0x01        // interrupt on received data
+#define UART_IER_THRI       0x02        // interrupt once the transmitter is empty
+#define UART_FCR_ENABLE     0x01
+#define UART_FCR_CLEAR      0x06        // both FIFOs
+#define UART_LCR_8N1        0x03
+#define UART_LCR_DLAB       0x80
+#define UART_LSR_DR         0x01        // a byte is waiting
+#define UART_LSR_THRE       0x20        // transmit FIFO is empty
+
+#define UART_FIFO_SIZE      16
+#define UART_RING_SIZE      256         // per direction, a power of 2
+
+extern bool uart_ready;     // console I/O goes through the driver from here on
+
+void uart_init(void);
+void uart_irq(void);
+int uart_read(char *buf, size_t len);
+void uart_write(const char *buf, size_t len);
+
+/*
+ * ----------------------------------------------------------------------------------
+ * BUFFER CACHE
+ * ----------------------------------------------------------------------------------
+ */
+
+/*
+ * Sector sized blocks cached between the file system and virtio-blk,
+ * indexed by a hash on the block number and evicted least recently used first.
+ * bread() hands back a buffer locked for the caller, brelse() gives it back.
+ * Writes only mark the buffer dirty, it reaches the disk on bsync() or when evicted.
+ */
+#define BCACHE_BUFS         64
+#define BCACHE_HASH         32      // buckets, power of 2
+#define BCACHE_READAHEAD    8       // blocks read along with a miss, if they aren't cached either
+
+struct buf {
+    uint32_t blockno;
+    bool valid;                 // data holds what's on disk, or newer
+    bool dirty;                 // data is newer than what's on disk
+    uint32_t refcount;          // holders, plus anyone waiting on the lock
+    struct sleeplock lock;      // held while using data
+    struct buf *hash_next;
+    struct buf *lru_prev;       // most recently released at the head
+    struct buf *lru_next;
+    uint8_t *data;              // SECTOR_SIZE bytes, DMA'd into directly
+};
+
+void bcache_init(void);
+struct buf *bread(uint32_t blockno);
+void bdirty(struct buf *b);
+void brelse(struct buf *b);
+void bsync(void);
+void bcache_invalidate(uint32_t blockno, uint32_t count);
+void bcache_dump(void);
+
 /*
  * ----------------------------------------------------------------------------------
  * FILE SYSTEM
  * ----------------------------------------------------------------------------------
  */
 
-#define FILES_MAX       2
-#define DISK_MAX_SIZE   align_up(sizeof(struct file) * FILES_MAX, SECTOR_SIZE)
-// currently all disks are read into memory at boot
-// this is a very tiny OS!
+#define FILES_INIT      64          // initial capacity of the file index and its hash, a power of 2
+#define FS_NAME_MAX     100         // full path, NUL excluded. A tar header holds this many without one
+
+#define FS_HOLE_NAME    ".hole"     // archive entry covering space no file owns anymore
 
 struct tar_header {
     char name[100];
@@ -166,13 +459,31 @@ struct tar_header {
     char data[];
 } __attribute__((packed));
 
+/*
+ * Index entry for one file, by full path. Contents stay on disk and are read
+ * and written through the buffer cache.
+ * The disk is either a tar archive or ashfs (see ashfs.h), fs_init() tells them apart.
+ */
 struct file {
     bool in_use;
-    char name[100];
-    char data[1024];    // TODO: do we want variable length?
+    bool dirty;         // header or inode is out of date, fs_flush() rewrites it
+    char name[FS_NAME_MAX + 1];
     size_t size;
+    uint32_t sector;    // tar: where its archive entry (header, then data) starts
+    uint32_t nsectors;  // tar: length of that entry. ashfs: data sectors allocated
+    uint32_t ino;       // ashfs: its inode, 0 on a tar disk
+    uint32_t nextents;
+    struct ashfs_extent extents[ASHFS_EXTENTS];     // ashfs: where the data is
+    struct file *hash_next;     // next in its fs_lookup() bucket
 };
 
+extern struct sleeplock fs_lock;    // held around anything touching files, may block on the disk
+
 void fs_flush(void);
+void fs_commit(struct file *file);
 struct file *fs_lookup(const char *filename);
+// `buf` is the current proc's memory for these two
+int fs_read(struct file *file, uint32_t off, void *buf, uint32_t len);
+int fs_write(struct file *file, uint32_t off, const void *buf, uint32_t len);
+int fs_truncate(struct file *file, uint32_t size);
 
@@ -35,6 +35,34 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
     return (struct sbiret){.error = a0, .value = a1};
 }
 
+void sbi_set_timer(uint64_t stime_value)
+{
+    /*
+     * long sbi_set_timer(uint64_t stime_value);
+     * Programs the next timer interrupt for when `time` reaches `stime_value`,
+     * and clears the pending one.
+     * On rv32 the 64 bit value is split across a0 (low) and a1 (high).
+     */
+    sbi_call((uint32_t) stime_value, (uint32_t) (stime_value >> 32), 0, 0, 0, 0,
+            0, SBI_EXT_TIME);
+}
+
+static struct sbiret sbi_hart_start(uint32_t hartid, uint32_t start_addr, uint32_t opaque)
+{
+    /*
+     * long sbi_hart_start(unsigned long hartid, unsigned long start_addr, unsigned long opaque);
+     * Starts a stopped hart in S-Mode at `start_addr`, with a0 = hartid, a1 = opaque,
+     * and paging and interrupts off.
+     */
+    return sbi_call(hartid, start_addr, opaque, 0, 0, 0, SBI_HSM_HART_START, SBI_EXT_HSM);
+}
+
+static struct sbiret sbi_hart_get_status(uint32_t hartid)
+{
+    // error is set for hartids that don't exist
+    return sbi_call(hartid, 0, 0, 0, 0, 0, SBI_HSM_HART_GET_STATUS, SBI_EXT_HSM);
+}
+
 extern uint8_t __stack_top[];
 
 __attribute__((section(".text.boot")))
@@ -44,15 +72,100 @@ void boot(void)
 	/*
 	 * kernel.ld points to here as start (section attribute)
 	 * __attribute__((naked)) removes prelude and epilog for function
+	 * OpenSBI picks the boot hart, so it isn't necessarily hart 0. a0 is its hartid.
 	 */
 	__asm__ __volatile__(
-		"mv sp, %[stack_top]\n"	// set stack pointer
-		"j kernel_main\n"	// jump to kernel main
+		"slli t0, a0, %[shift]\n"
+		"sub sp, %[stack_top], t0\n"	// set stack pointer, one slice per hart
+		"j kernel_main\n"	// jump to kernel main, hartid still in a0
 		:
-		: [stack_top] "r" (__stack_top)	// %[stack_top] in asm == __stack_top in C
+		: [stack_top] "r" (__stack_top),	// %[stack_top] in asm == __stack_top in C
+		  [shift] "i" (HART_STACK_SHIFT)
 	);
 }
 
+__attribute__((naked))
+void secondary_boot(void)
+{
+	// start_harts() points the other harts here, same deal as boot()
+	__asm__ __volatile__(
+		"slli t0, a0, %[shift]\n"
+		"sub sp, %[stack_top], t0\n"
+		"j secondary_main\n"
+		:
+		: [stack_top] "r" (__stack_top),
+		  [shift] "i" (HART_STACK_SHIFT)
+	);
+}
+
+uint32_t plic_enabled;      // IRQs taken by every hart, bit n for IRQ n
+
+void plic_enable(uint32_t irq)
+{
+    // any hart can take it, whoever claims it first handles it.
+    // Harts started later pick it up in hart_init().
+    *(volatile uint32_t *) PLIC_PRIORITY(irq) = 1;
+    plic_enabled |= 1u << irq;
+    *(volatile uint32_t *) PLIC_SENABLE(this_cpu()->hartid) = plic_enabled;
+}
+
+static void handle_external(void)
+{
+    uint32_t hartid = this_cpu()->hartid;
+    uint32_t irq = *(volatile uint32_t *) PLIC_SCLAIM(hartid);
+    switch (irq) {
+        case 0:
+            break;      // another hart claimed it first
+
+        case VIRTIO_BLK_IRQ:
+            virtio_blk_irq();
+            break;
+
+        case UART_IRQ:
+            uart_irq();
+            break;
+
+        default:
+            printf("plic: unexpected irq %d\n", irq);
+            break;
+    }
+    if (irq)
+        *(volatile uint32_t *) PLIC_SCLAIM(hartid) = irq;   // complete
+}
+
+void hart_init(struct cpu *cpu, uint32_t hartid)
+{
+    // per hart CSR setup, and tp pointed at `cpu` for this_cpu()
+    if (hartid >= HARTS_MAX)
+        PANIC("hart %d, only %d supported", hartid, HARTS_MAX);
+
+    cpu->hartid = hartid;
+    __asm__ __volatile__("mv tp, %0" :: "r"(cpu));
+
+    WRITE_CSR(stvec, (uint32_t) kernel_entry);
+    WRITE_CSR(sscratch, 0);     // tells kernel_entry we're trapping from S-Mode
+    WRITE_CSR(scounteren, SCOUNTEREN_CY | SCOUNTEREN_TM | SCOUNTEREN_IR);  // user benchmarks
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_STIE | SIE_SEIE);  // only taken in U-Mode or while idle
+
+    *(volatile uint32_t *) PLIC_SENABLE(hartid) = plic_enabled;
+    *(volatile uint32_t *) PLIC_STHRESHOLD(hartid) = 0;     // any priority gets through
+}
+
+void start_harts(uint32_t boot_hartid)
+{
+    for (uint32_t hartid = 0; hartid < HARTS_MAX; hartid++) {
+        if (hartid == boot_hartid)
+            continue;
+
+        struct sbiret status = sbi_hart_get_status(hartid);
+        if (status.error || status.value != SBI_HSM_STATE_STOPPED)
+            continue;   // not there, e.g. qemu started with fewer harts
+
+        if (sbi_hart_start(hartid, (uint32_t) secondary_boot, 0).error)
+            printf("hart %d failed to start\n", hartid);
+    }
+}
+
 long getchar(void)
 {
     /*
@@ -73,101 +186,548 @@ void putchar(char ch)
      *
      * Follows SBI calling conventions
      * EID 0x01
+     *
+     * Only until the UART driver takes over, after that output doesn't wait on the device.
      */
+    if (uart_ready) {
+        uart_write(&ch, 1);
+        return;
+    }
     sbi_call(ch, 0, 0, 0, 0, 0, 0, SYS_PUTCHAR); // EID = 0x01, arg 0 is ch
 }
 
+static int dbcn_present = -1;   // probed on first use
+
+void console_write(const char *buf, size_t len)
+{
+    /*
+     * `len` bytes of kernel memory to the console. With the SBI debug console
+     * extension that is one SBI call, or a few if it takes less than it was given.
+     * Without it, one legacy putchar per byte.
+     * DBCN wants a physical address, kernel memory is identity mapped.
+     * Once the UART driver is up it all just goes into its TX ring.
+     */
+    if (uart_ready) {
+        uart_write(buf, len);
+        return;
+    }
+    if (dbcn_present < 0)
+        dbcn_present = sbi_call(SBI_EXT_DBCN, 0, 0, 0, 0, 0, SBI_BASE_PROBE_EXTENSION, SBI_EXT_BASE).value != 0;
+
+    while (len) {
+        if (!dbcn_present) {
+            putchar(*buf++);
+            len--;
+            continue;
+        }
+
+        struct sbiret ret = sbi_call(len, (uint32_t) buf, 0, 0, 0, 0, SBI_DBCN_WRITE, SBI_EXT_DBCN);
+        if (ret.error) {
+            dbcn_present = 0;   // the rest goes out the slow way
+            continue;
+        }
+        buf += ret.value;
+        len -= ret.value;
+    }
+}
+
 /*
  * --------------------------------------------------------------------------------
  * EXCEPTION HANDLING
  * --------------------------------------------------------------------------------
  */
 
-extern volatile struct proc *current_proc;
-void handle_syscall(struct trap_frame *f)
+#define RW_SECTORS_MAX  64      // per syscall, bounds the kernel bounce buffer at 32KB
+
+static int sys_rw_sectors(unsigned sector, char *buf, uint32_t count, bool is_write)
 {
-    switch (f->a3) {    // syscall ID
-        case SYS_PUTCHAR:
-            putchar(f->a0);     // actual arg (XXX: definitely didn't check ;^) make this safe!)
-            break;
+    /*
+     * Through the buffer cache by default. With SECTOR_DIRECT it goes around it,
+     * zero-copy: the device DMAs straight to/from the user's pages.
+     * Only a buffer that doesn't translate into few enough pieces is bounced
+     * through kernel pages instead.
+     */
+    bool direct = count & SECTOR_DIRECT;
+    count &= ~SECTOR_DIRECT;
+    uint32_t nsectors = blk_sector_count();
+    if (!count || count > RW_SECTORS_MAX || sector >= nsectors || count > nsectors - sector)
+        return -1;
 
-        case SYS_GETCHAR:
-            while (1) {
-                long ch = getchar();
-                if (ch >= 0) {
-                    f->a0 = ch;
-                    break;
-                }
-                yield();        // yield on I/O
-            }
-            break;
+    uint32_t len = count * SECTOR_SIZE;
+    if (!user_range_ok((struct proc *) current_proc, (vaddr_t) buf, len, !is_write))
+        return -1;
 
-        case SYS_EXIT:
-            int pid = current_proc->pid;
-            printf("process %d exited\n", pid);
-            current_proc->state = EXITED;
-            yield();
-
-            // if this is ever reached, something is severely broken
-            PANIC("proc with pid %d resumed execution when it was meant for exiting\n");
-
-        case SYS_READFILE:
-        case SYS_WRITEFILE:
-            const char *filename = (const char *) f->a0;
-            char *buf = (char *) f->a1;
-            int len = f->a2;
-            struct file *file = fs_lookup(filename);
-            if (!file) {
-                printf("file not found: %s\n", filename);
-                f->a0 = -1;
-                break;
-            }
-            if (len > (int) sizeof(file->data))
-                len = file->size;
-            if (f->a3 == SYS_WRITEFILE) {
-                memcpy(file->data, buf, len);
-                file->size = len;
-                fs_flush();
+    if (!direct) {
+        for (uint32_t i = 0; i < count; i++, buf += SECTOR_SIZE) {
+            struct buf *b = bread(sector + i);
+            int ret;
+            if (is_write) {
+                ret = copy_from_user(b->data, buf, SECTOR_SIZE);
+                if (ret == 0)
+                    bdirty(b);
             } else {
-                memcpy(buf, file->data, len);
+                ret = copy_to_user(buf, b->data, SECTOR_SIZE);
             }
+            brelse(b);
+            if (ret < 0)
+                return -1;
+        }
+        return 0;
+    }
+    bcache_invalidate(sector, count);
 
-            f->a0 = len;
-            break;
+    struct blk_seg segs[BLK_SEGS_MAX];
+    int nsegs = user_segs_sv32((struct proc *) current_proc, (vaddr_t) buf, len, !is_write,
+            segs, BLK_SEGS_MAX);
+    if (nsegs > 0)
+        return blk_rw(sector, segs, nsegs, is_write);
 
-        default:
-            PANIC("unrecognized syscall a3=%x\n", f->a3);
-            break;
+    uint32_t npages = align_up(len, PAGE_SIZE) / PAGE_SIZE;
+    paddr_t bounce = alloc_pages_flags(npages, ALLOC_NOZERO);
+    int ret = is_write ? copy_from_user((void *) bounce, buf, len) : 0;
+
+    struct blk_seg seg = { bounce, len };
+    if (ret == 0)
+        ret = blk_rw(sector, &seg, 1, is_write);
+    if (ret == 0 && !is_write)
+        ret = copy_to_user(buf, (void *) bounce, len);
+
+    free_pages(bounce, pages_to_order(npages));
+    return ret;
+}
+
+static char console_getchar(void)
+{
+    // blocks on the UART's receive interrupt, or polls SBI before the driver is up
+    char ch;
+    if (uart_ready && uart_read(&ch, 1) == 1)
+        return ch;
+
+    while (1) {
+        long ch = getchar();
+        if (ch >= 0)
+            return ch;
+        zero_pool_refill();     // nothing else to do while waiting on input
+        yield();        // yield on I/O
+    }
+}
+
+#define CONSOLE_CHUNK   128     // bytes copied out of user memory per console_write()
+
+static int console_write_user(const char *buf, uint32_t len)
+{
+    // user memory may not be identity mapped, so it goes through a kernel buffer for DBCN
+    char chunk[CONSOLE_CHUNK];
+    for (uint32_t done = 0; done < len; ) {
+        uint32_t n = len - done < CONSOLE_CHUNK ? len - done : CONSOLE_CHUNK;
+        if (copy_from_user(chunk, buf + done, n) < 0)
+            return done ? (int) done : -1;
+        console_write(chunk, n);
+        done += n;
+    }
+    return len;
+}
+
+static int console_read_user(char *buf, uint32_t len)
+{
+    // blocks for the first byte, then whatever else has arrived
+    if (!len)
+        return 0;
+    if (uart_ready) {
+        char chunk[CONSOLE_CHUNK];
+        int n = uart_read(chunk, len < CONSOLE_CHUNK ? len : CONSOLE_CHUNK);
+        return copy_to_user(buf, chunk, n) < 0 ? -1 : n;
+    }
+    char ch = console_getchar();
+    return copy_to_user(buf, &ch, 1) < 0 ? -1 : 1;
+}
+
+static struct fd *fd_get(int fd)
+{
+    if (fd < 0 || fd >= FDS_MAX || current_proc->fds[fd].type == FD_NONE)
+        return NULL;
+    return &current_proc->fds[fd];
+}
+
+static int fd_open(const char *user_path, int flags)
+{
+    // lowest free descriptor for an existing file, -1 if there's no such file or no free slot
+    struct proc *proc = current_proc;
+    int fd = 0;
+    while (fd < FDS_MAX && proc->fds[fd].type != FD_NONE)
+        fd++;
+    if (fd == FDS_MAX)
+        return -1;
+
+    char path[FS_NAME_MAX + 1];
+    if (strncpy_from_user(path, user_path, sizeof(path)) < 0)
+        return -1;
+
+    sleep_lock(&fs_lock);
+    struct file *file = fs_lookup(path);
+    if (file && (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY && fs_truncate(file, 0) < 0)
+        file = NULL;
+    sleep_unlock(&fs_lock);
+    if (!file)
+        return -1;
+
+    proc->fds[fd].type = FD_FILE;
+    proc->fds[fd].file = file;
+    proc->fds[fd].offset = 0;
+    proc->fds[fd].flags = flags;
+    return fd;
+}
+
+static int fd_rw(int fd, char *buf, uint32_t len, bool is_write)
+{
+    /*
+     * Up to `len` bytes at the descriptor's offset, which moves past them.
+     * Reads stop short at the end of the file, writes grow it.
+     * Returns how many bytes were moved, or -1.
+     */
+    struct fd *f = fd_get(fd);
+    if (!f || (f->flags & O_ACCMODE) == (is_write ? O_RDONLY : O_WRONLY))
+        return -1;
+    if ((int) len < 0 || f->offset + len < f->offset)
+        return -1;
+    if (f->type == FD_CONSOLE)
+        return is_write ? console_write_user(buf, len) : console_read_user(buf, len);
+
+    sleep_lock(&fs_lock);
+    int n = is_write ? fs_write(f->file, f->offset, buf, len) : fs_read(f->file, f->offset, buf, len);
+    sleep_unlock(&fs_lock);
+    if (n > 0)
+        f->offset += n;
+    return n;
+}
+
+static int fd_lseek(int fd, int offset, int whence)
+{
+    /*
+     * Returns the new offset. Past the end is fine, a write there fills the gap with zeros.
+     * The sum is done unsigned, anything that wraps or doesn't fit the int result is refused.
+     */
+    struct fd *f = fd_get(fd);
+    if (!f || f->type != FD_FILE)
+        return -1;
+
+    uint32_t base;
+    if (whence == SEEK_SET)
+        base = 0;
+    else if (whence == SEEK_CUR)
+        base = f->offset;
+    else if (whence == SEEK_END)
+        base = f->file->size;
+    else
+        return -1;
+
+    uint32_t pos = base + (uint32_t) offset;
+    if (offset >= 0 ? pos < base : pos > base)
+        return -1;      // wrapped, i.e. before 0 or past 4GB
+    if ((int) pos < 0)
+        return -1;
+    f->offset = pos;
+    return pos;
+}
+
+static int fd_close(int fd)
+{
+    // the file's metadata goes to the buffer cache, data and all reach the disk with the next sync
+    struct fd *f = fd_get(fd);
+    if (!f)
+        return -1;
+
+    if (f->type == FD_FILE) {
+        sleep_lock(&fs_lock);
+        fs_commit(f->file);
+        sleep_unlock(&fs_lock);
     }
+    f->type = FD_NONE;
+    f->file = NULL;
+    return 0;
+}
+
+static int fd_fstat(int fd, struct stat *user_st)
+{
+    struct fd *f = fd_get(fd);
+    if (!f)
+        return -1;
+    struct stat st = { .size = f->type == FD_FILE ? f->file->size : 0 };
+    return copy_to_user(user_st, &st, sizeof(st));
+}
+
+/*
+ * Every syscall_table handler takes a0..a5 as they came from the user, and
+ * converts the ones it uses. One signature for all of them, so the table and
+ * kernel_entry's fast path call each through the same function type.
+ */
+#define SYSCALL_ARGS    __attribute__((unused)) uint32_t a0, __attribute__((unused)) uint32_t a1, \
+        __attribute__((unused)) uint32_t a2, __attribute__((unused)) uint32_t a3,               \
+        __attribute__((unused)) uint32_t a4, __attribute__((unused)) uint32_t a5
+
+static uint32_t sys_null(SYSCALL_ARGS)
+{
+    return 0;
+}
+
+static uint32_t sys_putchar(SYSCALL_ARGS)
+{
+    putchar((char) a0);
+    return 0;
+}
+
+static uint32_t sys_getchar(SYSCALL_ARGS)
+{
+    return console_getchar();
+}
+
+static uint32_t *kstack_top(struct proc *proc);
+
+static struct trap_frame *user_frame(void)
+{
+    // syscalls only come from U-Mode, so the frame is right under the KSTACK_* slots
+    return (struct trap_frame *) kstack_top(current_proc) - 1;
+}
+
+__attribute__((noreturn)) static uint32_t sys_exit(SYSCALL_ARGS)
+{
+    for (int fd = 0; fd < FDS_MAX; fd++)
+        fd_close(fd);
+    int pid = current_proc->pid;
+    printf("process %d exited\n", pid);
+    current_proc->state = EXITED;
+    yield();
+
+    // if this is ever reached, something is severely broken
+    PANIC("proc with pid %d resumed execution when it was meant for exiting\n", pid);
+}
+
+static uint32_t sys_meminfo(SYSCALL_ARGS)
+{
+    mem_dump();
+    bcache_dump();
+    return 0;
+}
+
+static uint32_t sys_yield(SYSCALL_ARGS)
+{
+    yield();
+    return 0;
+}
+
+static uint32_t sys_ps(SYSCALL_ARGS)
+{
+    proc_dump();
+    disk_dump();
+    return 0;
+}
+
+// raw block device access, for benchmarking the driver. `count` sectors at `sector` from/to `buf`
+static uint32_t sys_readsector(SYSCALL_ARGS)
+{
+    return sys_rw_sectors(a0, (char *) a1, a2, false);
+}
+
+static uint32_t sys_writesector(SYSCALL_ARGS)
+{
+    return sys_rw_sectors(a0, (char *) a1, a2, true);
 }
 
+static uint32_t sys_sync(SYSCALL_ARGS)
+{
+    sleep_lock(&fs_lock);
+    fs_flush();
+    sleep_unlock(&fs_lock);
+    return 0;
+}
+
+static uint32_t sys_open(SYSCALL_ARGS)
+{
+    return fd_open((const char *) a0, a1);
+}
+
+static uint32_t sys_read(SYSCALL_ARGS)
+{
+    return fd_rw(a0, (char *) a1, a2, false);
+}
+
+static uint32_t sys_write(SYSCALL_ARGS)
+{
+    return fd_rw(a0, (char *) a1, a2, true);
+}
+
+static uint32_t sys_lseek(SYSCALL_ARGS)
+{
+    return fd_lseek(a0, a1, a2);
+}
+
+static uint32_t sys_close(SYSCALL_ARGS)
+{
+    return fd_close(a0);
+}
+
+static uint32_t sys_fstat(SYSCALL_ARGS)
+{
+    return fd_fstat(a0, (struct stat *) a1);
+}
+
+static uint32_t sys_fork(SYSCALL_ARGS)
+{
+    // child resumes right after the ecall, same as the parent
+    return fork_proc(user_frame(), READ_CSR(sepc) + 4);
+}
+
+static int sys_rw_file(const char *user_filename, char *buf, int len, bool is_write)
+{
+    // a whole file by name in one go, from its start
+    char filename[FS_NAME_MAX + 1];
+    if (strncpy_from_user(filename, user_filename, sizeof(filename)) < 0)
+        return -1;
+
+    sleep_lock(&fs_lock);
+    struct file *file = fs_lookup(filename);
+    if (!file) {
+        sleep_unlock(&fs_lock);
+        printf("file not found: %s\n", filename);
+        return -1;
+    }
+    if (len < 0) {
+        len = -1;
+    } else if (is_write) {
+        // replaces the whole contents
+        if (fs_truncate(file, len) < 0 || fs_write(file, 0, buf, len) < 0)
+            len = -1;
+        fs_flush();
+    } else {
+        len = fs_read(file, 0, buf, len);
+    }
+    sleep_unlock(&fs_lock);
+    return len;
+}
+
+static uint32_t sys_readfile(SYSCALL_ARGS)
+{
+    return sys_rw_file((const char *) a0, (char *) a1, a2, false);
+}
+
+static uint32_t sys_writefile(SYSCALL_ARGS)
+{
+    return sys_rw_file((const char *) a0, (char *) a1, a2, true);
+}
+
+/*
+ * Indexed by the syscall number in a7. Arguments come in a0..a5 and the result
+ * goes back in a0, same as Linux.
+ */
+typedef uint32_t (*syscall_fn)(uint32_t a0, uint32_t a1, uint32_t a2,
+        uint32_t a3, uint32_t a4, uint32_t a5);
+#define SYSCALL_COUNT   (SYS_NULL + 1)      // one past the highest number
+
+_Static_assert(SYSCALL_COUNT <= 32, "syscall_fast is a 32 bit mask");
+
+const syscall_fn syscall_table[SYSCALL_COUNT] = {
+    [SYS_PUTCHAR]       = sys_putchar,
+    [SYS_GETCHAR]       = sys_getchar,
+    [SYS_EXIT]          = sys_exit,
+    [SYS_READFILE]      = sys_readfile,
+    [SYS_WRITEFILE]     = sys_writefile,
+    [SYS_MEMINFO]       = sys_meminfo,
+    [SYS_FORK]          = sys_fork,
+    [SYS_YIELD]         = sys_yield,
+    [SYS_PS]            = sys_ps,
+    [SYS_READSECTOR]    = sys_readsector,
+    [SYS_WRITESECTOR]   = sys_writesector,
+    [SYS_SYNC]          = sys_sync,
+    [SYS_OPEN]          = sys_open,
+    [SYS_READ]          = sys_read,
+    [SYS_WRITE]         = sys_write,
+    [SYS_LSEEK]         = sys_lseek,
+    [SYS_CLOSE]         = sys_close,
+    [SYS_FSTAT]         = sys_fstat,
+    [SYS_NULL]          = sys_null,
+};
+
+/*
+ * Syscalls kernel_entry runs straight from its fast path, bit n for syscall n.
+ * They must never sleep, yield, or touch the trap frame, which only has the
+ * caller-saved registers in it then. Faults on user memory are fine.
+ * Build with -DSYSCALL_NO_FAST to send everything the slow way, for comparison.
+ */
+#ifndef SYSCALL_NO_FAST
+const uint32_t syscall_fast = (1u << SYS_NULL) | (1u << SYS_PUTCHAR)
+        | (1u << SYS_LSEEK) | (1u << SYS_FSTAT);
+#else
+const uint32_t syscall_fast = 0;
+#endif
+
+void handle_syscall(struct trap_frame *f)
+{
+    // everything the fast path in kernel_entry didn't take
+    syscall_fn fn = f->a7 < SYSCALL_COUNT ? syscall_table[f->a7] : NULL;
+    if (!fn) {
+        printf("unrecognized syscall a7=%d\n", f->a7);
+        f->a0 = -1;
+        return;
+    }
+    f->a0 = fn(f->a0, f->a1, f->a2, f->a3, f->a4, f->a5);
+}
+
+static bool fixup_fault(uint32_t *pc);
+
 void handle_trap(struct trap_frame *f)
 {
     // TODO: handle different exceptions
     uint32_t scause = READ_CSR(scause);
-    uint32_t stval = READ_CSR(stval);
     uint32_t user_pc = READ_CSR(sepc);
+    uint32_t stval;
 
     //printf("\n\nscause: %x, SCAUSE_ECALL: %x\n\n", scause, SCAUSE_ECALL);
 
     switch (scause) {
+        case SCAUSE_STIMER:
+            // end of the time slice. Only preempt user code, the idle proc yields by itself.
+            timer_arm(time_slice_ticks);
+            if (!(f->sstatus & SSTATUS_SPP)) {
+                current_proc->nr_preempted++;
+                yield();
+            }
+            break;
+
+        case SCAUSE_SEXT:
+            handle_external();
+            break;
+
         case SCAUSE_ECALL:
             //printf("SCAUSE_ECALL trap\n");
             handle_syscall(f);
             user_pc += 4;       // move past syscall invocation
             break;
 
+        case SCAUSE_IFALT:
         case SCAUSE_LFALT:
-            PANIC("PAGE LOAD FAULT!!! paging is not yet implemented.\noffending instr at addr %x tried accessing %x\n\n", user_pc, stval);
+            // user memory is mapped on first touch, by the proc or by the kernel on its behalf
+            stval = READ_CSR(stval);
+            if (demand_page((struct proc *) current_proc, stval))
+                break;
+            if ((f->sstatus & SSTATUS_SPP) && fixup_fault(&user_pc))
+                break;      // a user copy hit a bad address, it returns -1
+            PANIC("PAGE LOAD FAULT!!! offending instr at addr %x tried accessing %x\n\n", user_pc, stval);
             break;
 
         case SCAUSE_SFALT:
-            // TODO: come back to this when we plan on supporting paging
-            PANIC("PAGE STORE FAULT!!! paging is not yet implemented.\noffending instr at addr %x tried accessing %x\n\n", user_pc, stval);
+            // first touch, or copy-on-write
+            stval = READ_CSR(stval);
+            if (demand_page((struct proc *) current_proc, stval))
+                break;
+            if (handle_cow_fault_sv32(current_proc->page_table, stval))
+                break;
+            if ((f->sstatus & SSTATUS_SPP) && fixup_fault(&user_pc))
+                break;
+            PANIC("PAGE STORE FAULT!!! offending instr at addr %x tried accessing %x\n\n", user_pc, stval);
             break;
 
         default:
-            PANIC("\r\nUNRECOGNIZED EXCEPTION: scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
+            PANIC("\r\nUNRECOGNIZED EXCEPTION: scause=%x, stval=%x, sepc=%x\n", scause, READ_CSR(stval), user_pc);
             break;
     }
 
@@ -186,13 +746,29 @@ void kernel_entry(void)
      * and must keep stack ptr set in a0 before calling `handle_trap`
      * to keep a valid trap_frame
      *
-     * Requires 31 available words on a kernel stack.
-     * Does not support nested interrupt handling.
+     * `sscratch` holds the top of the proc's kernel stack while in U-Mode,
+     * and 0 while in the kernel. A trap from S-Mode (e.g. the kernel touching
+     * a copy-on-write user page) pushes its frame on the stack it was already using.
+     * Coming from U-Mode, tp belongs to the user and the hart's own is
+     * read back from the KSTACK_CPU slot right above the frame.
+     * Past the first swap sscratch holds the user's sp, which may well be 0,
+     * so from there on sstatus.SPP tells where the trap came from.
+     *
+     * Syscalls marked in syscall_fast skip handle_trap and the callee-saved
+     * registers: the handler is called straight from here, and C preserves s0..s11
+     * for us anyway. Only those that can't switch procs qualify, a switch or
+     * fork needs the whole frame.
+     *
+     * Requires 32 available words on a kernel stack.
      */
     __asm__ __volatile__(
         "csrrw sp, sscratch, sp\n"  // get kernel stack; swaps in one instruction
+        "bnez sp, 1f\n"
+        "csrrw sp, sscratch, sp\n"  // came from S-Mode, swap back and stay on this stack
+        "1:\n"
 
-        "addi sp, sp, -4 * 31\n"
+        "addi sp, sp, -4 * 32\n"
+        // caller-saved first, they're all the fast path needs
         "sw ra,  4 * 0(sp)\n"
         "sw gp,  4 * 1(sp)\n"
         "sw tp,  4 * 2(sp)\n"
@@ -211,6 +787,64 @@ void kernel_entry(void)
         "sw a5,  4 * 15(sp)\n"
         "sw a6,  4 * 16(sp)\n"
         "sw a7,  4 * 17(sp)\n"
+
+        // fast path: an ecall from U-Mode whose bit is set in syscall_fast
+        "csrr t0, sstatus\n"
+        "andi t0, t0, %[spp]\n"
+        "bnez t0, 5f\n"            // from S-Mode
+        "csrr t1, scause\n"
+        "li t2, %[ecall]\n"
+        "bne t1, t2, 5f\n"
+        "li t2, %[nsys]\n"
+        "bgeu a7, t2, 5f\n"
+        "la t1, syscall_fast\n"
+        "lw t1, 0(t1)\n"
+        "srl t1, t1, a7\n"
+        "andi t1, t1, 1\n"
+        "beqz t1, 5f\n"
+
+        "csrr t0, sscratch\n"
+        "sw t0,  4 * 30(sp)\n"     // user sp
+        "sw s0,  4 * 18(sp)\n"
+        "sw s1,  4 * 19(sp)\n"
+        "lw tp,  4 * 32(sp)\n"     // KSTACK_CPU
+        "csrw sscratch, zero\n"
+        "csrr s0, sepc\n"          // callee-saved, a fault on user memory in the handler
+        "csrr s1, sstatus\n"       // would clobber the CSRs themselves
+        "la t1, syscall_table\n"
+        "slli t2, a7, 2\n"
+        "add t1, t1, t2\n"
+        "lw t1, 0(t1)\n"
+        "jalr t1\n"                // arguments still in a0..a5, result in a0
+        "addi s0, s0, 4\n"         // past the ecall
+        "csrw sepc, s0\n"
+        "csrw sstatus, s1\n"
+        "addi t0, sp, 4 * 32\n"
+        "csrw sscratch, t0\n"
+        "lw ra,  4 * 0(sp)\n"
+        "lw gp,  4 * 1(sp)\n"
+        "lw tp,  4 * 2(sp)\n"
+        "lw t0,  4 * 3(sp)\n"
+        "lw t1,  4 * 4(sp)\n"
+        "lw t2,  4 * 5(sp)\n"
+        "lw t3,  4 * 6(sp)\n"
+        "lw t4,  4 * 7(sp)\n"
+        "lw t5,  4 * 8(sp)\n"
+        "lw t6,  4 * 9(sp)\n"
+        "lw a1,  4 * 11(sp)\n"
+        "lw a2,  4 * 12(sp)\n"
+        "lw a3,  4 * 13(sp)\n"
+        "lw a4,  4 * 14(sp)\n"
+        "lw a5,  4 * 15(sp)\n"
+        "lw a6,  4 * 16(sp)\n"
+        "lw a7,  4 * 17(sp)\n"
+        "lw s0,  4 * 18(sp)\n"
+        "lw s1,  4 * 19(sp)\n"
+        "lw sp,  4 * 30(sp)\n"
+        "sret\n"
+
+        // everything else gets a full frame
+        "5:\n"
         "sw s0,  4 * 18(sp)\n"
         "sw s1,  4 * 19(sp)\n"
         "sw s2,  4 * 20(sp)\n"
@@ -224,20 +858,40 @@ void kernel_entry(void)
         "sw s10, 4 * 28(sp)\n"
         "sw s11, 4 * 29(sp)\n"
 
-        // stack pointer saved
+        // stack pointer saved: user sp from sscratch, or the kernel sp from before the frame
+        "csrr a0, sstatus\n"
+        "andi a0, a0, %[spp]\n"
+        "beqz a0, 2f\n"
+        "addi a0, sp, 4 * 32\n"
+        "j 3f\n"
+        "2:\n"
+        "lw tp, 4 * 32(sp)\n"      // KSTACK_CPU
         "csrr a0, sscratch\n"
+        "3:\n"
         "sw a0, 4 * 30(sp)\n"
+        "csrr a0, sstatus\n"
+        "sw a0, 4 * 31(sp)\n"
 
-        // change kernel stack
-        "addi a0, sp, 4 * 31\n"
-        "csrw sscratch, a0\n"
+        // in the kernel now
+        "csrw sscratch, zero\n"
 
         "mv a0, sp\n"
         "call handle_trap\n"
 
+        // falls through; also jumped to directly by freshly forked procs
+        ".global trap_return\n"
+        "trap_return:\n"
+        "lw a0, 4 * 31(sp)\n"
+        "csrw sstatus, a0\n"
+        "andi a0, a0, %[spp]\n"
+        "bnez a0, 4f\n"
+        "addi a0, sp, 4 * 32\n"     // back to U-Mode: next trap lands on top of this kernel stack
+        "csrw sscratch, a0\n"
+        "lw tp,  4 * 2(sp)\n"      // and the user gets its tp back, the kernel keeps its own
+        "4:\n"
+
         "lw ra,  4 * 0(sp)\n"
         "lw gp,  4 * 1(sp)\n"
-        "lw tp,  4 * 2(sp)\n"
         "lw t0,  4 * 3(sp)\n"
         "lw t1,  4 * 4(sp)\n"
         "lw t2,  4 * 5(sp)\n"
@@ -267,6 +921,10 @@ void kernel_entry(void)
         "lw s11, 4 * 29(sp)\n"
         "lw sp,  4 * 30(sp)\n"
         "sret\n"
+        :
+        : [spp] "i" (SSTATUS_SPP),
+          [ecall] "i" (SCAUSE_ECALL),
+          [nsys] "i" (SYSCALL_COUNT)
     );
 }
 
@@ -276,6 +934,35 @@ void kernel_entry(void)
  * --------------------------------------------------------------------------------
  */
 
+static uint64_t read_time(void)
+{
+    // time is 64 bits, read in two halves on rv32. Retry if the low half wrapped in between.
+    uint32_t hi, lo;
+    do {
+        hi = READ_CSR(timeh);
+        lo = READ_CSR(time);
+    } while (hi != READ_CSR(timeh));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+void timer_arm(uint32_t ticks)
+{
+    sbi_set_timer(read_time() + ticks);
+}
+
+void idle_wait(void)
+{
+    // interrupts are only enabled here, so the wakeup trap comes in from S-Mode
+    __asm__ __volatile__(
+        "csrs sstatus, %[sie]\n"
+        "wfi\n"
+        "csrc sstatus, %[sie]\n"
+        :
+        : [sie] "r" (SSTATUS_SIE)
+        : "memory"
+    );
+}
+
 __attribute__((naked))
 void switch_context(uint32_t *prev_sp, uint32_t *next_sp)
 {
@@ -325,19 +1012,32 @@ void switch_context(uint32_t *prev_sp, uint32_t *next_sp)
     );
 }
 
-extern struct proc procs[];
 extern char __kernel_base[], __free_ram_end[];
 
+static uint32_t *kstack_top(struct proc *proc)
+{
+    // the KSTACK_* slots sit at and above this, stacks grow down from it
+    return (uint32_t *) &proc->kern_stack[sizeof(proc->kern_stack) - KSTACK_RESERVED];
+}
+
 __attribute__((naked))
 void user_entry(void)
 {
+    /*
+     * switch_context popped everything init_proc_ctx pushed, so sp is the top of the kernel stack.
+     * finish_switch() only uses callee-saved registers and the stack, which is still sp here.
+     */
     __asm__ __volatile__(
-        "csrw sepc, %[sepc]         \n" // sepc sets pc when switching to U-Mode
-        "csrw sstatus, %[sstatus]   \n" // hardware interrupts enabled (SSTATUS_SPIE bit)
+        "call finish_switch         \n"
+        "csrw sscratch, sp          \n" // next trap from U-Mode lands on this kernel stack
+        "li t0, %[sepc]             \n"
+        "csrw sepc, t0              \n" // sepc sets pc when switching to U-Mode
+        "li t0, %[sstatus]          \n"
+        "csrw sstatus, t0           \n" // hardware interrupts enabled (SSTATUS_SPIE bit)
         "sret                       \n"
         :
-        : [sepc] "r" (USER_BASE),       // TODO: change this to be a parameter or something
-          [sstatus] "r" (SSTATUS_SPIE | SSTATUS_SUM)
+        : [sepc] "i" (USER_BASE),       // TODO: change this to be a parameter or something
+          [sstatus] "i" (SSTATUS_SPIE | SSTATUS_SUM)
     );
 }
 
@@ -345,7 +1045,7 @@ __attribute__((always_inline))
 struct proc *init_proc_ctx(struct proc *proc, const void *image, size_t image_size)
 {
     // context stored on kernel stack
-    uint32_t *sp = (uint32_t *) &proc->kern_stack[sizeof(proc->kern_stack)];    // start at top of stack
+    uint32_t *sp = kstack_top(proc);    // start at top of stack
     for (int i = 0; i < 12; i++)    // initialize s11, s10, s9, s8, etc to 0
         *--sp = 0;
     *--sp = (uint32_t) (uint32_t) user_entry;  // ra (returns to user_entry function in kernel)
@@ -356,6 +1056,43 @@ struct proc *init_proc_ctx(struct proc *proc, const void *image, size_t image_si
     return proc;
 }
 
+__attribute__((naked))
+void fork_entry(void)
+{
+    /*
+     * First thing a forked child runs, returned into by switch_context.
+     * sp points at the trap frame copied by init_fork_ctx, with the user pc in KSTACK_USER_PC.
+     */
+    __asm__ __volatile__(
+        "call finish_switch\n"
+        "lw t0, 4 * 33(sp)\n"
+        "csrw sepc, t0\n"
+        "j trap_return\n"
+    );
+}
+
+void init_fork_ctx(struct proc *child, struct trap_frame *frame, uint32_t user_pc)
+{
+    /*
+     * Lays out the child's kernel stack as if it had trapped at `user_pc`:
+     * [trap frame][switch_context regs] from the top down, user pc stashed above.
+     */
+    uint32_t *sp = kstack_top(child);
+    sp[KSTACK_USER_PC] = user_pc;
+
+    sp -= sizeof(struct trap_frame) / sizeof(uint32_t);
+    struct trap_frame *child_frame = (struct trap_frame *) sp;
+    memcpy(child_frame, frame, sizeof(*child_frame));
+    child_frame->a0 = 0;                        // fork() returns 0 in the child
+    child_frame->sstatus &= ~SSTATUS_SPP;       // always heading back to U-Mode
+
+    for (int i = 0; i < 12; i++)    // s11..s0, trap_return reloads the real ones
+        *--sp = 0;
+    *--sp = (uint32_t) fork_entry;  // ra
+
+    child->sp = (uint32_t) sp;
+}
+
 /*
  * --------------------------------------------------------------------------------
  * SATP_V32 VIRTUAL MEMORY
@@ -371,6 +1108,8 @@ void map_page_sv32(uint32_t *table1, vaddr_t vaddr, paddr_t paddr, uint32_t flag
         PANIC("unaligned paddr %x", paddr);
 
     uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if (table1[vpn1] & PAGE_LEAF)
+        PANIC("vaddr %x falls in a megapage", vaddr);
     if (!(table1[vpn1] & PAGE_V)) {
         // Create the 1st level page table if it doesn't exist.
         uint32_t pt_paddr = alloc_pages(1);
@@ -383,17 +1122,454 @@ void map_page_sv32(uint32_t *table1, vaddr_t vaddr, paddr_t paddr, uint32_t flag
     table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
 }
 
-__attribute__((always_inline))
-void save_kern_state(struct proc* next)
+void map_megapage_sv32(uint32_t *table1, vaddr_t vaddr, paddr_t paddr, uint32_t flags)
+{
+    // maps 4MB with a single leaf PTE in the root table
+    if (!is_aligned(vaddr, MEGAPAGE_SIZE))
+        PANIC("unaligned megapage vaddr %x", vaddr);
+
+    if (!is_aligned(paddr, MEGAPAGE_SIZE))
+        PANIC("unaligned megapage paddr %x", paddr);
+
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+}
+
+bool in_megapage_sv32(uint32_t *table1, vaddr_t vaddr)
+{
+    // whether `vaddr` is covered by a leaf in the root table, i.e. kernel memory or MMIO
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    return (table1[vpn1] & PAGE_V) && (table1[vpn1] & PAGE_LEAF);
+}
+
+uint32_t *walk_sv32(uint32_t *table1, vaddr_t vaddr)
+{
+    // returns the leaf PTE for `vaddr`, or NULL if there's no 2nd level table for it
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if (!(table1[vpn1] & PAGE_V) || (table1[vpn1] & PAGE_LEAF))
+        return NULL;
+
+    uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
+    uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+    return &table0[vpn0];
+}
+
+uint32_t *copy_page_table_sv32(uint32_t *table1)
+{
+    /*
+     * Builds a copy of `table1` for a forked proc.
+     * User pages aren't copied: writable ones lose PAGE_W and gain PAGE_COW
+     * in both tables, and each shared page picks up a reference.
+     * Kernel megapages are copied as-is.
+     */
+    uint32_t *copy1 = (uint32_t *) alloc_pages(1);
+    for (uint32_t vpn1 = 0; vpn1 < PAGE_SIZE / sizeof(uint32_t); vpn1++) {
+        if (!(table1[vpn1] & PAGE_V))
+            continue;
+        if (table1[vpn1] & PAGE_LEAF) {
+            copy1[vpn1] = table1[vpn1];
+            continue;
+        }
+
+        uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+        uint32_t *copy0 = (uint32_t *) alloc_pages(1);
+        for (uint32_t vpn0 = 0; vpn0 < PAGE_SIZE / sizeof(uint32_t); vpn0++) {
+            uint32_t pte = table0[vpn0];
+            if ((pte & PAGE_V) && (pte & PAGE_U)) {
+                if (pte & PAGE_W)
+                    pte = (pte & ~PAGE_W) | PAGE_COW;
+                table0[vpn0] = pte;
+                page_ref((pte >> 10) * PAGE_SIZE);
+            }
+            copy0[vpn0] = pte;
+        }
+        copy1[vpn1] = (((paddr_t) copy0 / PAGE_SIZE) << 10) | PAGE_V;
+    }
+
+    // parent's writable user pages just became read-only
+    __asm__ __volatile__("sfence.vma");
+    return copy1;
+}
+
+bool handle_cow_fault_sv32(uint32_t *table1, vaddr_t vaddr)
+{
+    /*
+     * Resolves a store fault on a copy-on-write page.
+     * The last proc holding a reference just gets write access back,
+     * anyone else gets a private copy.
+     * Returns false if `vaddr` isn't a COW page, i.e. it's a real fault.
+     */
+    uint32_t *pte = walk_sv32(table1, vaddr);
+    if (!pte || !(*pte & PAGE_V) || !(*pte & PAGE_COW))
+        return false;
+
+    paddr_t old = (*pte >> 10) * PAGE_SIZE;
+    uint32_t flags = (*pte & 0x3ff & ~PAGE_COW) | PAGE_W;
+    if (page_refcount(old) == 1) {
+        *pte = (*pte & ~0x3ff) | flags;
+    } else {
+        paddr_t copy = alloc_pages_flags(1, ALLOC_NOZERO);    // about to be overwritten
+        memcpy((void *) copy, (void *) old, PAGE_SIZE);
+        *pte = ((copy / PAGE_SIZE) << 10) | flags;
+        page_unref(old);
+    }
+
+    __asm__ __volatile__("sfence.vma %0, zero" :: "r"(vaddr) : "memory");
+    return true;
+}
+
+int user_segs_sv32(struct proc *proc, vaddr_t vaddr, uint32_t len, bool writable,
+        struct blk_seg *segs, int max_segs)
+{
+    /*
+     * Translates a user buffer into the physical pieces backing it, so a device can
+     * DMA straight to/from it. Pages are faulted in first, and with `writable`
+     * copy-on-write pages are broken so the device doesn't write into a shared page.
+     * Physically adjacent pages are merged. Returns the number of segments,
+     * or -1 if the buffer isn't valid user memory or needs more than `max_segs`.
+     */
+    if (vaddr < USER_BASE || vaddr >= USER_END || len > USER_END - vaddr)
+        return -1;
+
+    int nsegs = 0;
+    while (len) {
+        vaddr_t page_vaddr = vaddr & ~(PAGE_SIZE - 1);
+        uint32_t *pte = walk_sv32(proc->page_table, page_vaddr);
+        if (!pte || !(*pte & PAGE_V)) {
+            demand_page(proc, page_vaddr);
+            pte = walk_sv32(proc->page_table, page_vaddr);
+            if (!pte)
+                return -1;
+        }
+        if (writable && (*pte & PAGE_COW))
+            handle_cow_fault_sv32(proc->page_table, page_vaddr);
+        if (!(*pte & PAGE_U) || (writable && !(*pte & PAGE_W)))
+            return -1;
+
+        paddr_t paddr = (*pte >> 10) * PAGE_SIZE + (vaddr - page_vaddr);
+        uint32_t chunk = PAGE_SIZE - (vaddr - page_vaddr);
+        if (chunk > len)
+            chunk = len;
+
+        if (nsegs && segs[nsegs - 1].paddr + segs[nsegs - 1].len == paddr) {
+            segs[nsegs - 1].len += chunk;
+        } else {
+            if (nsegs == max_segs)
+                return -1;
+            segs[nsegs].paddr = paddr;
+            segs[nsegs].len = chunk;
+            nsegs++;
+        }
+        vaddr += chunk;
+        len -= chunk;
+    }
+    return nsegs;
+}
+
+bool user_range_ok(struct proc *proc, vaddr_t vaddr, uint32_t len, bool writable)
 {
+    /*
+     * Whether `proc` may access [vaddr, vaddr + len) at all.
+     * Pages that aren't mapped yet pass, demand_page() maps them on first touch.
+     * Mapped ones need PAGE_U, and with `writable` PAGE_W or PAGE_COW as well.
+     * A megapage is never user memory: walk_sv32() has no PTE to give for it,
+     * and the kernel's global mapping would happily take the access.
+     */
+    if (vaddr < USER_BASE || vaddr >= USER_END || len > USER_END - vaddr)
+        return false;
+
+    for (vaddr_t page = vaddr & ~(PAGE_SIZE - 1); page < vaddr + len; page += PAGE_SIZE) {
+        if (in_megapage_sv32(proc->page_table, page))
+            return false;
+        uint32_t *pte = walk_sv32(proc->page_table, page);
+        if (!pte || !(*pte & PAGE_V))
+            continue;
+        if (!(*pte & PAGE_U) || (writable && !(*pte & (PAGE_W | PAGE_COW))))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Any load or store in [start, end) may fault on a user address nothing can map.
+ * handle_trap() resumes such a fault at `fixup` instead of panicking,
+ * which makes the copy return -1.
+ */
+struct fixup {
+    const char *start;
+    const char *end;
+    const char *fixup;
+};
+
+extern const char user_copy_start[], user_copy_end[], user_copy_fault[];
+extern const char user_strncpy_start[], user_strncpy_end[], user_strncpy_fault[];
+
+static const struct fixup fixups[] = {
+    { user_copy_start, user_copy_end, user_copy_fault },
+    { user_strncpy_start, user_strncpy_end, user_strncpy_fault },
+};
+
+static bool fixup_fault(uint32_t *pc)
+{
+    for (size_t i = 0; i < sizeof(fixups) / sizeof(fixups[0]); i++) {
+        if (*pc >= (uint32_t) fixups[i].start && *pc < (uint32_t) fixups[i].end) {
+            *pc = (uint32_t) fixups[i].fixup;
+            return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((naked))
+__attribute__((noinline))
+static int user_copy(void *dst, const void *src, uint32_t len)
+{
+    /*
+     * memcpy that's allowed to fault, returns 0 or -1.
+     * Words once both pointers are aligned, 4 of them per round while they last.
+     * Pointers that can never line up go byte by byte.
+     */
     __asm__ __volatile__(
-        "sfence.vma\n"
-        "csrw satp, %[satp]\n"
-        "sfence.vma\n"
-        "csrw sscratch, %[sscratch]\n"
-        :
-        : [satp] "r" (SATP_V32 | ((uint32_t) next->page_table / PAGE_SIZE)),
-          [sscratch] "r" ((uint32_t) &next->kern_stack[sizeof(next->kern_stack)])
+        ".global user_copy_start\n"
+        "user_copy_start:\n"
+        "xor t0, a0, a1\n"
+        "andi t0, t0, 3\n"
+        "bnez t0, 4f\n"
+
+        "1:\n"                      // bytes up to the first aligned word
+        "andi t0, a0, 3\n"
+        "beqz t0, 2f\n"
+        "beqz a2, 5f\n"
+        "lbu t1, 0(a1)\n"
+        "sb t1, 0(a0)\n"
+        "addi a0, a0, 1\n"
+        "addi a1, a1, 1\n"
+        "addi a2, a2, -1\n"
+        "j 1b\n"
+
+        "2:\n"                      // 16 bytes per round
+        "li t0, 16\n"
+        "bltu a2, t0, 3f\n"
+        "lw t1, 0(a1)\n"
+        "lw t2, 4(a1)\n"
+        "lw t3, 8(a1)\n"
+        "lw t4, 12(a1)\n"
+        "sw t1, 0(a0)\n"
+        "sw t2, 4(a0)\n"
+        "sw t3, 8(a0)\n"
+        "sw t4, 12(a0)\n"
+        "addi a0, a0, 16\n"
+        "addi a1, a1, 16\n"
+        "addi a2, a2, -16\n"
+        "j 2b\n"
+
+        "3:\n"                      // remaining words
+        "li t0, 4\n"
+        "bltu a2, t0, 4f\n"
+        "lw t1, 0(a1)\n"
+        "sw t1, 0(a0)\n"
+        "addi a0, a0, 4\n"
+        "addi a1, a1, 4\n"
+        "addi a2, a2, -4\n"
+        "j 3b\n"
+
+        "4:\n"                      // tail, or everything if misaligned
+        "beqz a2, 5f\n"
+        "lbu t1, 0(a1)\n"
+        "sb t1, 0(a0)\n"
+        "addi a0, a0, 1\n"
+        "addi a1, a1, 1\n"
+        "addi a2, a2, -1\n"
+        "j 4b\n"
+
+        "5:\n"
+        "li a0, 0\n"
+        "ret\n"
+        ".global user_copy_end\n"
+        "user_copy_end:\n"
+
+        ".global user_copy_fault\n"
+        "user_copy_fault:\n"
+        "li a0, -1\n"
+        "ret\n"
     );
 }
 
+__attribute__((naked))
+__attribute__((noinline))
+static int user_strncpy(char *dst, const char *src, uint32_t n)
+{
+    // up to `n` bytes including the NUL, returns the length without it, n if there's no NUL, or -1
+    __asm__ __volatile__(
+        ".global user_strncpy_start\n"
+        "user_strncpy_start:\n"
+        "li a3, 0\n"
+        "1:\n"
+        "beq a3, a2, 2f\n"
+        "add t0, a1, a3\n"
+        "lbu t1, 0(t0)\n"
+        "add t0, a0, a3\n"
+        "sb t1, 0(t0)\n"
+        "beqz t1, 2f\n"
+        "addi a3, a3, 1\n"
+        "j 1b\n"
+        "2:\n"
+        "mv a0, a3\n"
+        "ret\n"
+        ".global user_strncpy_end\n"
+        "user_strncpy_end:\n"
+
+        ".global user_strncpy_fault\n"
+        "user_strncpy_fault:\n"
+        "li a0, -1\n"
+        "ret\n"
+    );
+}
+
+int copy_from_user(void *dst, const void *src, uint32_t len)
+{
+    // `len` bytes of the current proc's memory at `src` into the kernel. Returns 0, or -1 if it isn't all valid
+    if (!user_range_ok((struct proc *) current_proc, (vaddr_t) src, len, false))
+        return -1;
+    return user_copy(dst, src, len);
+}
+
+int copy_to_user(void *dst, const void *src, uint32_t len)
+{
+    // `len` bytes of kernel memory out to the current proc's `dst`. Returns 0, or -1 if it isn't all valid
+    if (!user_range_ok((struct proc *) current_proc, (vaddr_t) dst, len, true))
+        return -1;
+    return user_copy(dst, src, len);
+}
+
+int strncpy_from_user(char *dst, const char *src, uint32_t n)
+{
+    /*
+     * A NUL terminated user string into `dst`, which holds `n` bytes.
+     * Returns its length, or -1 if it isn't valid user memory or doesn't fit.
+     */
+    vaddr_t vaddr = (vaddr_t) src;
+    if (vaddr < USER_BASE || vaddr >= USER_END)
+        return -1;
+    if (n > USER_END - vaddr)
+        n = USER_END - vaddr;   // the string has to end before user memory does
+    if (!n || !user_range_ok((struct proc *) current_proc, vaddr, n, false))
+        return -1;
+
+    int len = user_strncpy(dst, src, n);
+    return len == (int) n ? -1 : len;
+}
+
+void free_page_table_sv32(uint32_t *table1)
+{
+    /*
+     * Drops the reference on every user (PAGE_U) page mapped by `table1`,
+     * and frees every 2nd level table and `table1` itself.
+     * Kernel megapages are identity mapped and owned by nobody, so they're left alone.
+     */
+    for (uint32_t vpn1 = 0; vpn1 < PAGE_SIZE / sizeof(uint32_t); vpn1++) {
+        if (!(table1[vpn1] & PAGE_V) || (table1[vpn1] & PAGE_LEAF))
+            continue;
+
+        uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+        for (uint32_t vpn0 = 0; vpn0 < PAGE_SIZE / sizeof(uint32_t); vpn0++) {
+            uint32_t pte = table0[vpn0];
+            if ((pte & PAGE_V) && (pte & PAGE_U))
+                page_unref((pte >> 10) * PAGE_SIZE);
+        }
+        free_pages((paddr_t) table0, 0);
+    }
+    free_pages((paddr_t) table1, 0);
+}
+
+/*
+ * ASIDs are handed out in generations. Within a generation every proc gets
+ * its own ASID, so switching never needs a flush. When they run out,
+ * the generation bumps and each hart flushes its whole TLB once, the next
+ * time it switches, while procs pick up fresh ASIDs as they're next switched to.
+ * ASID 0 is never handed out so a generation of 0 means "no ASID yet".
+ */
+struct spinlock asid_lock;      // everything below
+uint32_t asid_mask;             // ASID bits the hardware implements, probed on first switch
+bool asid_probed;
+uint32_t asid_generation = 1;
+uint32_t asid_next = 1;
+
+static void asid_probe(uint32_t satp)
+{
+    // unimplemented ASID bits read back as zero
+    WRITE_CSR(satp, satp | SATP_ASID_MASK);
+    asid_mask = (READ_CSR(satp) & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+    asid_probed = true;
+    __asm__ __volatile__("sfence.vma\n" ::: "memory");
+    printf("satp: %d ASIDs available\n", asid_mask);
+}
+
+static bool asid_assign(struct proc *proc)
+{
+    // returns true if `proc` got a fresh ASID, which no hart has anything cached for
+    if (proc->asid_gen == asid_generation)
+        return false;
+
+    if (asid_next > asid_mask) {
+        asid_generation++;
+        asid_next = 1;
+    }
+    proc->asid = asid_next++;
+    proc->asid_gen = asid_generation;
+    return true;
+}
+
+__attribute__((always_inline))
+void save_kern_state(struct proc* next)
+{
+    /*
+     * sscratch is 0 for as long as we're in the kernel, trap_return/user_entry set it
+     *
+     * Every proc, idle included, runs on its own table now. Borrowing the outgoing
+     * table for idle isn't safe once another hart can free it out from under us.
+     */
+    struct cpu *cpu = this_cpu();
+    kstack_top(next)[KSTACK_CPU] = (uint32_t) cpu;
+
+    // a proc's own faults only sfence the hart they happen on,
+    // so whatever this hart cached for it before it moved away may be stale
+    bool migrated = next->last_hart != cpu->hartid;
+    next->last_hart = cpu->hartid;
+
+    uint32_t ppn = (uint32_t) next->page_table / PAGE_SIZE;
+    spin_lock(&asid_lock);
+    if (!asid_probed)
+        asid_probe(SATP_V32 | ppn);
+
+    if (!asid_mask) {
+        spin_unlock(&asid_lock);
+        // no ASIDs, every switch is a full flush
+        __asm__ __volatile__(
+            "sfence.vma\n"
+            "csrw satp, %[satp]\n"
+            "sfence.vma\n"
+            :
+            : [satp] "r" (SATP_V32 | ppn)
+        );
+        return;
+    }
+
+    if (asid_assign(next))
+        migrated = false;
+    bool flush = cpu->asid_generation != asid_generation;    // rolled over since this hart last flushed
+    cpu->asid_generation = asid_generation;
+    uint32_t asid = next->asid;
+    spin_unlock(&asid_lock);
+
+    uint32_t satp = SATP_V32 | (asid << SATP_ASID_SHIFT) | ppn;
+    if (READ_CSR(satp) == satp && !flush && !migrated)
+        return;     // already loaded
+
+    // entries tagged with another ASID can stay, they can't match this one
+    __asm__ __volatile__("csrw satp, %[satp]\n" :: [satp] "r" (satp) : "memory");
+    if (flush)
+        __asm__ __volatile__("sfence.vma\n" ::: "memory");
+    else if (migrated)
+        __asm__ __volatile__("sfence.vma zero, %[asid]\n" :: [asid] "r" (asid) : "memory");
+}
@@ -34,6 +34,23 @@ struct sbiret
 struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
 		long arg5, long fid, long eid);
 
+#define SBI_EXT_TIME    0x54494D45  // "TIME"
+
+void sbi_set_timer(uint64_t stime_value);
+
+// Hart State Management, chapter 9
+#define SBI_EXT_HSM             0x48534D    // "HSM"
+#define SBI_HSM_HART_START      0
+#define SBI_HSM_HART_GET_STATUS 2
+#define SBI_HSM_STATE_STOPPED   1
+
+#define SBI_EXT_BASE                0x10
+#define SBI_BASE_PROBE_EXTENSION    3
+
+// Debug Console, chapter 12. Whole buffers per call instead of the legacy putchar
+#define SBI_EXT_DBCN            0x4442434E  // "DBCN"
+#define SBI_DBCN_WRITE          0
+
 /*
  * --------------------------------------------------------------------------------
  * EXCEPTION HANDLING
@@ -72,8 +89,15 @@ struct trap_frame {
     uint32_t s10;
     uint32_t s11;
     uint32_t sp;
+    uint32_t sstatus;   // SPP tells trap_return whether it's going back to U or S-Mode
 } __attribute__((packed));
 
+#define SSTATUS_SPP     (1 << 8)    // previous privilege, set if trapped from S-Mode
+#define SSTATUS_SIE     (1 << 1)    // S-Mode interrupts enabled, kept clear in the kernel
+
+#define SIE_STIE        (1 << 5)    // supervisor timer interrupt enable
+#define SIE_SEIE        (1 << 9)    // supervisor external interrupt enable, i.e. the PLIC
+
 #define READ_CSR(reg)                                           \
     ({                                                          \
         unsigned long __tmp;                                    \
@@ -88,6 +112,25 @@ struct trap_frame {
     } while (0)                                                 \
 
 void kernel_entry(void);
+void trap_return(void);
+
+/*
+ * PLIC on qemu virt. Each hart has an M-Mode and an S-Mode context,
+ * the S-Mode one being context 2 * hartid + 1.
+ * Everything the kernel touches sits in the first megapage.
+ */
+#define PLIC_PADDR              0x0c000000
+#define PLIC_PRIORITY(irq)      (PLIC_PADDR + 4 * (irq))
+#define PLIC_SENABLE(hart)      (PLIC_PADDR + 0x2080 + 0x100 * (hart))
+#define PLIC_STHRESHOLD(hart)   (PLIC_PADDR + 0x201000 + 0x2000 * (hart))
+#define PLIC_SCLAIM(hart)       (PLIC_STHRESHOLD(hart) + 4)
+
+void plic_enable(uint32_t irq);
+
+// counters U-Mode is allowed to read with rdcycle/rdtime/rdinstret
+#define SCOUNTEREN_CY   (1 << 0)
+#define SCOUNTEREN_TM   (1 << 1)
+#define SCOUNTEREN_IR   (1 << 2)
 
 /*
  * --------------------------------------------------------------------------------
@@ -95,9 +138,34 @@ void kernel_entry(void);
  * --------------------------------------------------------------------------------
  */
 
+/*
+ * Each hart boots on its own slice of the stack in kernel.ld, 2^HART_STACK_SHIFT bytes,
+ * and keeps a pointer to its `struct cpu` in tp while in the kernel.
+ * U-Mode owns tp, so kernel_entry reloads it from a slot at the very top of
+ * the proc's kernel stack, just above where the trap frame lands.
+ */
+#define HART_STACK_SHIFT    15          // 32KB, HARTS_MAX of them fit in kernel.ld's 128KB
+
+#define KSTACK_CPU          0           // `struct cpu` of the hart the proc was last switched in on
+#define KSTACK_USER_PC      1           // where a forked child starts, see init_fork_ctx()
+#define KSTACK_RESERVED     (4 * 4)     // bytes kept free above the trap frame, stays 16B aligned
+
+static inline struct cpu *this_cpu(void)
+{
+    struct cpu *cpu;
+    __asm__ __volatile__("mv %0, tp" : "=r"(cpu));
+    return cpu;
+}
+
+void hart_init(struct cpu *cpu, uint32_t hartid);
+void start_harts(uint32_t boot_hartid);
+
 void switch_context(uint32_t *prev_sp, uint32_t *next_sp);
+void timer_arm(uint32_t ticks);
+void idle_wait(void);
 
 struct proc *init_proc_ctx(struct proc *proc, const void *image, size_t image_size);
+void init_fork_ctx(struct proc *child, struct trap_frame *frame, uint32_t user_pc);
 
 /*
  * --------------------------------------------------------------------------------
@@ -106,13 +174,32 @@ struct proc *init_proc_ctx(struct proc *proc, const void *image, size_t image_si
  */
 
 #define SATP_V32    (1u << 31)
+#define SATP_ASID_SHIFT 22
+#define SATP_ASID_MASK  (0x1ff << SATP_ASID_SHIFT)  // 9 bits at most, hardware may implement fewer
 #define PAGE_V      (1 << 0)    // valid
 #define PAGE_R      (1 << 1)    // readable
 #define PAGE_W      (1 << 2)    // writable
 #define PAGE_X      (1 << 3)    // executable
 #define PAGE_U      (1 << 4)    // U-Mode accessible
+#define PAGE_G      (1 << 5)    // global, present in every address space (kernel only)
+#define PAGE_COW    (1 << 8)    // RSW bit: writable once the page has been copied
+
+#define PAGE_LEAF   (PAGE_R | PAGE_W | PAGE_X)  // any of these set in a PTE ends the walk
+#define MEGAPAGE_SIZE   (4 * 1024 * 1024)       // leaf in the root table
 
 void map_page_sv32(uint32_t *table1, vaddr_t vaddr, paddr_t paddr, uint32_t flags);
+void map_megapage_sv32(uint32_t *table1, vaddr_t vaddr, paddr_t paddr, uint32_t flags);
+uint32_t *walk_sv32(uint32_t *table1, vaddr_t vaddr);
+bool in_megapage_sv32(uint32_t *table1, vaddr_t vaddr);
+uint32_t *copy_page_table_sv32(uint32_t *table1);
+bool handle_cow_fault_sv32(uint32_t *table1, vaddr_t vaddr);
+void free_page_table_sv32(uint32_t *table1);
+int user_segs_sv32(struct proc *proc, vaddr_t vaddr, uint32_t len, bool writable,
+        struct blk_seg *segs, int max_segs);
+bool user_range_ok(struct proc *proc, vaddr_t vaddr, uint32_t len, bool writable);
+int copy_from_user(void *dst, const void *src, uint32_t len);
+int copy_to_user(void *dst, const void *src, uint32_t len);
+int strncpy_from_user(char *dst, const char *src, uint32_t n);
 
 void save_kern_state(struct proc *next);
 
@@ -126,6 +213,10 @@ void save_kern_state(struct proc *next);
 // ^^^ page 124, section 12.1
 // RISC-V specs seem to change locations over time so check the website
 #define SCAUSE_ECALL 0x8        // environment call from U-Mode
+#define SCAUSE_IFALT 0xC        // instruction page fault
 #define SCAUSE_SFALT 0xF        // store/AMO page fault
 #define SCAUSE_LFALT 0xD        // load page fault
+#define SCAUSE_INTR  (1u << 31) // set for interrupts, clear for exceptions
+#define SCAUSE_STIMER (SCAUSE_INTR | 5) // supervisor timer interrupt
+#define SCAUSE_SEXT  (SCAUSE_INTR | 9)  // supervisor external interrupt, from the PLIC
 
@@ -0,0 +1,201 @@
+/*
+ * Builds an ashfs disk image on the host, see sys/ashfs.h for the format.
+ *
+ *  mkfs <image> <sectors> <file>...
+ *
+ * Files keep their path, `disk/hello.txt` ends up as hello.txt in directory disk,
+ * so the kernel indexes it under the same name a tar archive would give it.
+ * Every file gets one extent, whatever is left over is free for the kernel to grow into.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../sys/ashfs.h"
+
+static uint8_t *image;
+static struct ashfs_super *super;
+static uint32_t next_ino;
+static uint32_t next_sector;
+
+// directory contents are collected here and laid out once every file is in
+struct dir {
+    uint32_t ino;
+    uint32_t count;
+    struct ashfs_dirent *dirents;
+};
+static struct dir *dirs;
+static uint32_t ndirs;
+
+static void die(const char *msg, const char *what)
+{
+    fprintf(stderr, "mkfs: %s%s%s\n", msg, what ? ": " : "", what ? what : "");
+    exit(1);
+}
+
+static struct ashfs_inode *inode_at(uint32_t ino)
+{
+    return (struct ashfs_inode *) (image + super->inode_start * ASHFS_SECTOR_SIZE) + ino;
+}
+
+static uint32_t inode_alloc(uint16_t type)
+{
+    if (next_ino == super->ninodes)
+        die("out of inodes", NULL);
+    inode_at(next_ino)->type = type;
+    return next_ino++;
+}
+
+static uint32_t data_alloc(uint32_t nsectors)
+{
+    if (next_sector + nsectors > super->nsectors)
+        die("image too small", NULL);
+    uint32_t start = next_sector;
+    next_sector += nsectors;
+    return start;
+}
+
+static struct dir *dir_of(uint32_t ino)
+{
+    for (uint32_t i = 0; i < ndirs; i++) {
+        if (dirs[i].ino == ino)
+            return &dirs[i];
+    }
+
+    dirs = realloc(dirs, (ndirs + 1) * sizeof(*dirs));
+    dirs[ndirs] = (struct dir) { .ino = ino };
+    return &dirs[ndirs++];
+}
+
+static uint32_t dir_find(uint32_t dir_ino, const char *name)
+{
+    struct dir *dir = dir_of(dir_ino);
+    for (uint32_t i = 0; i < dir->count; i++) {
+        if (!strcmp(dir->dirents[i].name, name))
+            return dir->dirents[i].ino;
+    }
+    return 0;
+}
+
+static void dir_add(uint32_t dir_ino, const char *name, uint32_t ino)
+{
+    if (strlen(name) >= ASHFS_NAME_MAX)
+        die("name too long", name);
+
+    struct dir *dir = dir_of(dir_ino);
+    dir->dirents = realloc(dir->dirents, (dir->count + 1) * sizeof(*dir->dirents));
+    struct ashfs_dirent *dirent = &dir->dirents[dir->count++];
+    memset(dirent, 0, sizeof(*dirent));
+    dirent->ino = ino;
+    strcpy(dirent->name, name);
+}
+
+static void add_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        die("can't open", path);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    // walk down the path, making directories as needed
+    char *copy = strdup(path);
+    uint32_t dir = ASHFS_ROOT_INO;
+    char *name = copy;
+    while (!strncmp(name, "./", 2))
+        name += 2;
+    for (char *slash; (slash = strchr(name, '/')); name = slash + 1) {
+        *slash = '\0';
+        if (!*name)
+            continue;
+        uint32_t sub = dir_find(dir, name);
+        if (!sub) {
+            sub = inode_alloc(ASHFS_T_DIR);
+            dir_add(dir, name, sub);
+        } else if (inode_at(sub)->type != ASHFS_T_DIR) {
+            die("not a directory", name);
+        }
+        dir = sub;
+    }
+    if (dir_find(dir, name))
+        die("duplicate file", path);
+
+    uint32_t ino = inode_alloc(ASHFS_T_FILE);
+    dir_add(dir, name, ino);
+    struct ashfs_inode *inode = inode_at(ino);
+    inode->size = size;
+    uint32_t nsectors = (size + ASHFS_SECTOR_SIZE - 1) / ASHFS_SECTOR_SIZE;
+    if (nsectors) {
+        inode->nextents = 1;
+        inode->extents[0].start = data_alloc(nsectors);
+        inode->extents[0].len = nsectors;
+        if (fread(image + inode->extents[0].start * ASHFS_SECTOR_SIZE, 1, size, f) != (size_t) size)
+            die("can't read", path);
+    }
+
+    free(copy);
+    fclose(f);
+}
+
+static void lay_out_dirs(void)
+{
+    for (uint32_t i = 0; i < ndirs; i++) {
+        struct ashfs_inode *inode = inode_at(dirs[i].ino);
+        uint32_t size = dirs[i].count * sizeof(struct ashfs_dirent);
+        uint32_t nsectors = (size + ASHFS_SECTOR_SIZE - 1) / ASHFS_SECTOR_SIZE;
+        inode->size = size;
+        if (nsectors) {
+            inode->nextents = 1;
+            inode->extents[0].start = data_alloc(nsectors);
+            inode->extents[0].len = nsectors;
+            memcpy(image + inode->extents[0].start * ASHFS_SECTOR_SIZE, dirs[i].dirents, size);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: mkfs <image> <sectors> <file>...\n");
+        return 1;
+    }
+
+    uint32_t nsectors = strtoul(argv[2], NULL, 0);
+    image = calloc(nsectors, ASHFS_SECTOR_SIZE);
+    super = (struct ashfs_super *) image;
+    super->magic = ASHFS_MAGIC;
+    super->nsectors = nsectors;
+    super->bitmap_start = 1;
+    super->bitmap_sectors = (nsectors + ASHFS_BITS_PER_SECTOR - 1) / ASHFS_BITS_PER_SECTOR;
+    super->inode_start = super->bitmap_start + super->bitmap_sectors;
+    // one inode per 8 sectors, a full inode table sector at least
+    super->ninodes = (nsectors / 8 + ASHFS_INODES_PER_SECTOR - 1) / ASHFS_INODES_PER_SECTOR * ASHFS_INODES_PER_SECTOR;
+    if (super->ninodes < ASHFS_INODES_PER_SECTOR)
+        super->ninodes = ASHFS_INODES_PER_SECTOR;
+    super->data_start = super->inode_start + super->ninodes / ASHFS_INODES_PER_SECTOR;
+    if (super->data_start >= nsectors)
+        die("image too small", NULL);
+    next_sector = super->data_start;
+
+    inode_alloc(ASHFS_T_FREE);      // inode 0 means "no inode"
+    inode_alloc(ASHFS_T_DIR);       // root
+    dir_of(ASHFS_ROOT_INO);
+    for (int i = 3; i < argc; i++)
+        add_file(argv[i]);
+    lay_out_dirs();
+
+    // everything up to next_sector is taken
+    uint8_t *bitmap = image + super->bitmap_start * ASHFS_SECTOR_SIZE;
+    for (uint32_t s = 0; s < next_sector; s++)
+        bitmap[s / 8] |= 1 << (s % 8);
+
+    FILE *out = fopen(argv[1], "wb");
+    if (!out || fwrite(image, ASHFS_SECTOR_SIZE, nsectors, out) != nsectors)
+        die("can't write", argv[1]);
+    fclose(out);
+    printf("mkfs: %s, %u files and directories, %u of %u sectors used\n", argv[1],
+            next_ino - ASHFS_ROOT_INO, next_sector, nsectors);
+    return 0;
+}
@@ -4,6 +4,7 @@ extern char __stack_top[];
 
 __attribute__((noreturn)) void exit(void)
 {
+    flush();
     syscall(SYS_EXIT, 0, 0, 0);
     for (;;)    
         printf("process didn't exit!!!\n");     // XXX: hopefully this isn't reached.
@@ -23,6 +24,22 @@ void start(void)
     );
 }
 
+// XXX: specific to RISC-V, kernel has to allow it through scounteren
+uint32_t rdcycle(void)
+{
+    uint32_t cycles;
+    __asm__ __volatile__("rdcycle %0" : "=r"(cycles));
+    return cycles;
+}
+
+uint32_t rdtime(void)
+{
+    // wall clock ticks, unlike cycles these keep counting while other procs run
+    uint32_t ticks;
+    __asm__ __volatile__("rdtime %0" : "=r"(ticks));
+    return ticks;
+}
+
 /*
  * --------------------------------------------------------------------------------
  * SYSCALLS
@@ -30,39 +47,139 @@ void start(void)
  */
 
 // XXX: specific to RISC-V
-int syscall(int sysno, int arg0, int arg1, int arg2)
+// number in a7, arguments in a0..a5, result in a0, like Linux
+int syscall6(int sysno, int arg0, int arg1, int arg2, int arg3, int arg4, int arg5)
 {
     register int a0 __asm__("a0") = arg0;
     register int a1 __asm__("a1") = arg1;
     register int a2 __asm__("a2") = arg2;
-    register int a3 __asm__("a3") = sysno;
+    register int a3 __asm__("a3") = arg3;
+    register int a4 __asm__("a4") = arg4;
+    register int a5 __asm__("a5") = arg5;
+    register int a7 __asm__("a7") = sysno;
 
     __asm__ __volatile__("ecall"
             : "=r"(a0)
-            : "r"(a0), "r"(a1), "r"(a2), "r"(a3)
+            : "r"(a0), "r"(a1), "r"(a2), "r"(a3), "r"(a4), "r"(a5), "r"(a7)
             : "memory");
     return a0;
 }
 
+int syscall(int sysno, int arg0, int arg1, int arg2)
+{
+    // the common case, a3..a5 go in as 0
+    return syscall6(sysno, arg0, arg1, arg2, 0, 0, 0);
+}
+
+/*
+ * stdout is line buffered, printf() costs one SYS_WRITE per line
+ * rather than a trap per character. Anything pending goes out before
+ * reading input, forking, or exiting.
+ */
+#define STDOUT_BUF_SIZE 128
+
+static char stdout_buf[STDOUT_BUF_SIZE];
+static int stdout_len;
+
+void flush(void)
+{
+    if (stdout_len)
+        write(1, stdout_buf, stdout_len);
+    stdout_len = 0;
+}
+
 long getchar(void)
 {
+    flush();    // e.g. the shell's prompt and echo
     return syscall(SYS_GETCHAR, 0, 0, 0);
 }
 
 void putchar(char c)
 {
-    syscall(SYS_PUTCHAR, c, 0, 0);
+    stdout_buf[stdout_len++] = c;
+    if (c == '\n' || stdout_len == STDOUT_BUF_SIZE)
+        flush();
 }
 
 int readfile(const char *filename, char *buf, int len)
 {
-    // TODO: implement
-    syscall(SYS_READFILE, (int)filename, (int)buf, (int)len);
+    return syscall(SYS_READFILE, (int)filename, (int)buf, (int)len);
 }
 
 int writefile(const char *filename, const char *buf, int len)
 {
-    // TODO: implement
-    syscall(SYS_WRITEFILE, (int)filename, (int)buf, (int)len);
+    return syscall(SYS_WRITEFILE, (int)filename, (int)buf, (int)len);
+}
+
+
+void meminfo(void)
+{
+    syscall(SYS_MEMINFO, 0, 0, 0);
 }
 
+int fork(void)
+{
+    // 0 in the child, child's pid in the parent, -1 on failure
+    flush();    // or both would print it
+    return syscall(SYS_FORK, 0, 0, 0);
+}
+
+void sched_yield(void)
+{
+    syscall(SYS_YIELD, 0, 0, 0);
+}
+
+void ps(void)
+{
+    syscall(SYS_PS, 0, 0, 0);
+}
+
+int readsector(unsigned sector, char *buf, int count)
+{
+    // `buf` must hold `count` whole 512 byte sectors, at most 64.
+    // Or SECTOR_DIRECT into `count` to skip the buffer cache
+    return syscall(SYS_READSECTOR, (int) sector, (int) buf, count);
+}
+
+int writesector(unsigned sector, const char *buf, int count)
+{
+    return syscall(SYS_WRITESECTOR, (int) sector, (int) buf, count);
+}
+
+void sync(void)
+{
+    // write back every changed file and everything dirty in the buffer cache
+    syscall(SYS_SYNC, 0, 0, 0);
+}
+
+int open(const char *path, int flags)
+{
+    // a descriptor, or -1. Files can't be created yet, `path` has to exist
+    return syscall(SYS_OPEN, (int) path, flags, 0);
+}
+
+int read(int fd, void *buf, int len)
+{
+    // bytes read, 0 at the end of the file, or -1
+    return syscall(SYS_READ, fd, (int) buf, len);
+}
+
+int write(int fd, const void *buf, int len)
+{
+    return syscall(SYS_WRITE, fd, (int) buf, len);
+}
+
+int lseek(int fd, int offset, int whence)
+{
+    return syscall(SYS_LSEEK, fd, offset, whence);
+}
+
+int close(int fd)
+{
+    return syscall(SYS_CLOSE, fd, 0, 0);
+}
+
+int fstat(int fd, struct stat *st)
+{
+    return syscall(SYS_FSTAT, fd, (int) st, 0);
+}
@@ -3,6 +3,9 @@
 
 __attribute__((noreturn)) void exit(void);
 void putchar(char ch);
+void flush(void);
+uint32_t rdcycle(void);
+uint32_t rdtime(void);
 
 /*
  * --------------------------------------------------------------------------------
@@ -11,6 +14,20 @@ void putchar(char ch);
  */
 
 int syscall(int sysno, int arg0, int arg1, int arg2);
+int syscall6(int sysno, int arg0, int arg1, int arg2, int arg3, int arg4, int arg5);
 int readfile(const char *filename, char *buf, int len);
 int writefile(const char *filename, const char *buf, int len);
+void meminfo(void);
+int fork(void);
+void sched_yield(void);
+void ps(void);
+int readsector(unsigned sector, char *buf, int count);
+int writesector(unsigned sector, const char *buf, int count);
+void sync(void);
+int open(const char *path, int flags);
+int read(int fd, void *buf, int len);
+int write(int fd, const void *buf, int len);
+int lseek(int fd, int offset, int whence);
+int close(int fd);
+int fstat(int fd, struct stat *st);
 